@@ -0,0 +1,129 @@
+/*
+ * Microbenchmark of the UTF-8 decoder in `src/utf8.h` against the
+ * scalar, non-validating decoder it replaced.
+ *
+ *     cc -O2 -march=native -Isrc bench/utf8.c -o utf8bench && ./utf8bench
+ *
+ * Leave out `-march=native` to see the portable path.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "utf8.h"
+
+#define SIZE (16 << 20)
+#define ROUNDS 10
+
+/* The decoder as it was, kept here for comparison. */
+static inline unsigned old_utf8chrlen(const char *s, unsigned l)
+{
+        unsigned i = 0;
+        while (s++ && ++i < l && UTF8CONT(*s));
+        return i;
+}
+
+static inline unsigned old_utf8decode(const char *s, unsigned l, uint32_t *c)
+{
+        unsigned len = old_utf8chrlen(s, l);
+
+        *c = (*s & ((1 << (8 - len)) - 1))
+                << (len - 1) * 6;
+        for (unsigned i = 1; i < len; i++)
+                *c |= (s[i] & 0x3F) << (len - i - 1) * 6;
+
+        return len;
+}
+
+static double now(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Fills `buf` with copies of `s`, cut off at a character boundary. */
+static size_t fill(char *buf, const char *s)
+{
+        size_t len = strlen(s), n = 0;
+        while (n + len <= SIZE) memcpy(buf + n, s, len), n += len;
+        return n;
+}
+
+static uint32_t out[4096];
+
+static uint32_t run_old(const char *buf, size_t len)
+{
+        uint32_t sum = 0, c;
+
+        for (size_t i = 0; i < len;) {
+                i += old_utf8decode(buf + i, len - i, &c);
+                sum += c;
+        }
+
+        return sum;
+}
+
+static uint32_t run_new(const char *buf, size_t len)
+{
+        uint32_t sum = 0;
+
+        for (size_t i = 0, used; i < len; i += used) {
+                size_t k = utf8transcode(buf + i, len - i, out,
+                                         sizeof out / sizeof *out, false, &used);
+                for (size_t j = 0; j < k; j++) sum += out[j];
+        }
+
+        return sum;
+}
+
+static double bench(uint32_t (*f)(const char *, size_t), const char *buf,
+                    size_t len, uint32_t *sum)
+{
+        double best = 1e9;
+
+        for (int r = 0; r < ROUNDS; r++) {
+                double t = now();
+                *sum = f(buf, len);
+                t = now() - t;
+                if (t < best) best = t;
+        }
+
+        return len / best / 1e6;
+}
+
+int main(void)
+{
+        static const struct {
+                const char *name, *text;
+        } corpus[] = {
+                { "latin", "Größenänderung des Fensters übernehmen. " },
+                { "cyrillic", "Изменение размера окна терминала. " },
+                { "cjk", "端末のウィンドウサイズを変更する。漢字かな交じり文。" },
+                { "emoji", "😀🎉🚀🔥✨👍🏽🧵🪐" },
+                { "mixed", "ls -la → 合計 42 │ drwxr-xr-x ├── src/ └── README ✓\n" },
+        };
+
+        char *buf = malloc(SIZE);
+        if (!buf) return 1;
+
+        printf("%-10s %12s %12s\n", "corpus", "old MB/s", "new MB/s");
+
+        for (size_t i = 0; i < sizeof corpus / sizeof *corpus; i++) {
+                size_t len = fill(buf, corpus[i].text);
+                uint32_t a, b;
+                double old = bench(run_old, buf, len, &a);
+                double new = bench(run_new, buf, len, &b);
+
+                printf("%-10s %12.0f %12.0f%s\n", corpus[i].name, old, new,
+                       a == b ? "" : "  (results differ)");
+        }
+
+        free(buf);
+
+        return 0;
+}
@@ -1,53 +1,189 @@
 #include "esc.h"
 
-#include <limits.h>  /* LONG_MAX, LONG_MIN */
-#include <stdlib.h>  /* strtol */
+#include "utf8.h"    /* utf8encode */
 
-#include <stdio.h>   /* snprintf */
-#include <string.h>  /* strlen */
+#define T(action, state) ((action) << 4 | (state))
 
-void csiparse(struct csi *csi)
+/* C0 controls other than CAN, SUB and ESC, which go anywhere. */
+#define C0(e) [0x00 ... 0x17] = (e), [0x19] = (e), [0x1c ... 0x1f] = (e)
+
+/* Transitions which apply in every state. */
+#define ANYWHERE                                                \
+        [0x18] = T(ACT_EXECUTE, ESC_GROUND),                    \
+        [0x1a] = T(ACT_EXECUTE, ESC_GROUND),                    \
+        [0x1b] = T(ACT_NONE, ESC_ESCAPE),                       \
+        [0x80 ... 0x8f] = T(ACT_EXECUTE, ESC_GROUND),           \
+        [0x90] = T(ACT_NONE, ESC_DCS_ENTRY),                    \
+        [0x91 ... 0x97] = T(ACT_EXECUTE, ESC_GROUND),           \
+        [0x98] = T(ACT_NONE, ESC_SOS_STRING),                   \
+        [0x99 ... 0x9a] = T(ACT_EXECUTE, ESC_GROUND),           \
+        [0x9b] = T(ACT_NONE, ESC_CSI_ENTRY),                    \
+        [0x9c] = T(ACT_NONE, ESC_GROUND),                       \
+        [0x9d] = T(ACT_NONE, ESC_OSC_STRING),                   \
+        [0x9e ... 0x9f] = T(ACT_NONE, ESC_SOS_STRING)
+
+#define STAY(action) T(action, 0)
+
+const uint8_t esc_table[ESC_STATE_MAX][0xa1] = {
+        [ESC_GROUND] = {
+                ANYWHERE,
+                C0(STAY(ACT_EXECUTE)),
+                [0x20 ... 0x7e] = STAY(ACT_PRINT),
+                [0xa0] = STAY(ACT_PRINT),
+        },
+        [ESC_ESCAPE] = {
+                ANYWHERE,
+                C0(STAY(ACT_EXECUTE)),
+                [0x20 ... 0x2f] = T(ACT_COLLECT, ESC_ESCAPE_INTERMEDIATE),
+                [0x30 ... 0x4f] = T(ACT_ESC_DISPATCH, ESC_GROUND),
+                [0x50] = T(ACT_NONE, ESC_DCS_ENTRY),
+                [0x51 ... 0x57] = T(ACT_ESC_DISPATCH, ESC_GROUND),
+                [0x58] = T(ACT_NONE, ESC_SOS_STRING),
+                [0x59 ... 0x5a] = T(ACT_ESC_DISPATCH, ESC_GROUND),
+                [0x5b] = T(ACT_NONE, ESC_CSI_ENTRY),
+                [0x5c] = T(ACT_ESC_DISPATCH, ESC_GROUND),
+                [0x5d] = T(ACT_NONE, ESC_OSC_STRING),
+                [0x5e ... 0x5f] = T(ACT_NONE, ESC_SOS_STRING),
+                [0x60 ... 0x6a] = T(ACT_ESC_DISPATCH, ESC_GROUND),
+                [0x6b] = T(ACT_NONE, ESC_OSC_STRING),
+                [0x6c ... 0x7e] = T(ACT_ESC_DISPATCH, ESC_GROUND),
+        },
+        [ESC_ESCAPE_INTERMEDIATE] = {
+                ANYWHERE,
+                C0(STAY(ACT_EXECUTE)),
+                [0x20 ... 0x2f] = STAY(ACT_COLLECT),
+                [0x30 ... 0x7e] = T(ACT_ESC_DISPATCH, ESC_GROUND),
+        },
+        [ESC_CSI_ENTRY] = {
+                ANYWHERE,
+                C0(STAY(ACT_EXECUTE)),
+                [0x20 ... 0x2f] = T(ACT_COLLECT, ESC_CSI_INTERMEDIATE),
+                [0x30 ... 0x3b] = T(ACT_PARAM, ESC_CSI_PARAM),
+                [0x3c ... 0x3f] = T(ACT_COLLECT, ESC_CSI_PARAM),
+                [0x40 ... 0x7e] = T(ACT_CSI_DISPATCH, ESC_GROUND),
+        },
+        [ESC_CSI_PARAM] = {
+                ANYWHERE,
+                C0(STAY(ACT_EXECUTE)),
+                [0x20 ... 0x2f] = T(ACT_COLLECT, ESC_CSI_INTERMEDIATE),
+                [0x30 ... 0x3b] = STAY(ACT_PARAM),
+                [0x3c ... 0x3f] = T(ACT_NONE, ESC_CSI_IGNORE),
+                [0x40 ... 0x7e] = T(ACT_CSI_DISPATCH, ESC_GROUND),
+        },
+        [ESC_CSI_INTERMEDIATE] = {
+                ANYWHERE,
+                C0(STAY(ACT_EXECUTE)),
+                [0x20 ... 0x2f] = STAY(ACT_COLLECT),
+                [0x30 ... 0x3f] = T(ACT_NONE, ESC_CSI_IGNORE),
+                [0x40 ... 0x7e] = T(ACT_CSI_DISPATCH, ESC_GROUND),
+        },
+        [ESC_CSI_IGNORE] = {
+                ANYWHERE,
+                C0(STAY(ACT_EXECUTE)),
+                [0x40 ... 0x7e] = T(ACT_NONE, ESC_GROUND),
+        },
+        [ESC_DCS_ENTRY] = {
+                ANYWHERE,
+                [0x20 ... 0x2f] = T(ACT_COLLECT, ESC_DCS_INTERMEDIATE),
+                [0x30 ... 0x3b] = T(ACT_PARAM, ESC_DCS_PARAM),
+                [0x3c ... 0x3f] = T(ACT_COLLECT, ESC_DCS_PARAM),
+                [0x40 ... 0x7e] = T(ACT_NONE, ESC_DCS_PASSTHROUGH),
+        },
+        [ESC_DCS_PARAM] = {
+                ANYWHERE,
+                [0x20 ... 0x2f] = T(ACT_COLLECT, ESC_DCS_INTERMEDIATE),
+                [0x30 ... 0x3b] = STAY(ACT_PARAM),
+                [0x3c ... 0x3f] = T(ACT_NONE, ESC_DCS_IGNORE),
+                [0x40 ... 0x7e] = T(ACT_NONE, ESC_DCS_PASSTHROUGH),
+        },
+        [ESC_DCS_INTERMEDIATE] = {
+                ANYWHERE,
+                [0x20 ... 0x2f] = STAY(ACT_COLLECT),
+                [0x30 ... 0x3f] = T(ACT_NONE, ESC_DCS_IGNORE),
+                [0x40 ... 0x7e] = T(ACT_NONE, ESC_DCS_PASSTHROUGH),
+        },
+        [ESC_DCS_PASSTHROUGH] = {
+                ANYWHERE,
+                C0(STAY(ACT_PUT)),
+                [0x20 ... 0x7e] = STAY(ACT_PUT),
+                [0xa0] = STAY(ACT_PUT),
+        },
+        [ESC_DCS_IGNORE] = {
+                ANYWHERE,
+        },
+        [ESC_OSC_STRING] = {
+                ANYWHERE,
+                [0x07] = T(ACT_NONE, ESC_GROUND),
+                [0x20 ... 0x7e] = STAY(ACT_PUT),
+                [0xa0] = STAY(ACT_PUT),
+        },
+        [ESC_SOS_STRING] = {
+                ANYWHERE,
+                [0x20 ... 0x7e] = STAY(ACT_PUT),
+                [0xa0] = STAY(ACT_PUT),
+        },
+};
+
+/* Big enough for any sensible parameter without overflowing. */
+#define CSI_ARG_MAX 0xffffff
+
+void csiclear(struct csi *csi)
 {
         csi->narg = 0;
-        csi->buf[csi->len] = 0;
-
-        char *p = csi->buf;
+        csi->arg[0] = 0;
+        csi->sub[0] = false;
+        csi->overflow = false;
+        csi->priv = 0;
+        csi->inter = 0;
+        csi->ninter = 0;
+        csi->mode = 0;
+}
 
-        if (*p == '?') {
-                csi->priv = 1;
-                p++;
+void csicollect(struct csi *csi, uint32_t c)
+{
+        if (c >= 0x3c && c <= 0x3f) {
+                csi->priv = c;
+                return;
         }
 
-        while (p < csi->buf + csi->len) {
-                char *np = 0;
-                long v = strtol(p, &np, 10);
-                if (np == p) break;
-                if (v == LONG_MAX || v == LONG_MIN) v = -1;
-                csi->arg[csi->narg++] = v;
-                p = np;
-
-                /*
-                 * TODO: Investigate why some applications seem to use
-                 * : instead of ; for some sequences.
-                 */
-                if ((*p != ';' && *p != ':') || csi->narg == ESC_ARG_SIZE)
-                        break;
-                p++;
+        if (!csi->ninter++) csi->inter = c;
+}
+
+/*
+ * Take the next character of the parameters: a digit goes onto the
+ * current parameter and a separator starts a new one. A parameter
+ * which was never given any digits is zero, which means "default".
+ */
+void csiparam(struct csi *csi, uint32_t c)
+{
+        if (csi->overflow) return;
+        if (!csi->narg) csi->narg = 1;
+
+        if (c == ';' || c == ':') {
+                if (csi->narg == ESC_ARG_SIZE) {
+                        csi->overflow = true;
+                        return;
+                }
+
+                csi->sub[csi->narg] = c == ':';
+                csi->arg[csi->narg++] = 0;
+                return;
         }
 
-        csi->mode[0] = *p++;
-        csi->mode[1] = (p < csi->buf + csi->len) ? *p : 0;
+        long *arg = csi->arg + csi->narg - 1;
+        if (*arg < CSI_ARG_MAX) *arg = *arg * 10 + c - '0';
+}
+
+void strescput(struct stresc *stresc, uint32_t c)
+{
+        uint8_t buf[4];
+        unsigned len;
 
-#ifdef DEBUG
-        static char buf[2048] = { 0 };
-        snprintf(buf, sizeof buf, "%.*s%s -> ", csi->len, csi->buf, csi->priv ? " (priv)" : "");
-        for (int i = 0; i < csi->narg; i++)
-                snprintf(buf + strlen(buf), sizeof buf - strlen(buf), "%ld ", csi->arg[i]);
-        snprintf(buf + strlen(buf), sizeof buf - strlen(buf), "mode %c mode %d\n", csi->mode[0], csi->mode[1]);
-        _printf("%s", buf);
-#endif
+        if (utf8encode(c, buf, &len)) return;
+        if (stresc->len + len >= sizeof stresc->buf) return;
 
-        csi->len = 0;
+        for (unsigned i = 0; i < len; i++)
+                stresc->buf[stresc->len++] = buf[i];
 }
 
 void strescparse(struct stresc *stresc)
@@ -1,24 +1,78 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "util.h"    /* ESC_ARG_SIZE */
 
-struct csi {
-        /* TODO: Don't hard code this buffer size. */
-        char buf[2048];
-        unsigned len;
+/*
+ * The states of the escape sequence parser. This is Paul Williams'
+ * DEC-compatible parser (https://vt100.net/emu/dec_ansi_parser) with
+ * `:` accepted as a parameter separator, BEL accepted as the end of
+ * an OSC string, and ESC k starting a string like OSC does.
+ *
+ * Zero isn't a state; in `esc_table` it means "stay put and ignore
+ * the character".
+ */
+enum esc_state {
+        ESC_GROUND = 1,
+        ESC_ESCAPE,
+        ESC_ESCAPE_INTERMEDIATE,
+        ESC_CSI_ENTRY,
+        ESC_CSI_PARAM,
+        ESC_CSI_INTERMEDIATE,
+        ESC_CSI_IGNORE,
+        ESC_DCS_ENTRY,
+        ESC_DCS_PARAM,
+        ESC_DCS_INTERMEDIATE,
+        ESC_DCS_PASSTHROUGH,
+        ESC_DCS_IGNORE,
+        ESC_OSC_STRING,
+        ESC_SOS_STRING,         /* SOS, PM and APC */
+        ESC_STATE_MAX,
+};
 
+enum esc_action {
+        ACT_NONE,
+        ACT_PRINT,              /* Print the character */
+        ACT_EXECUTE,            /* Execute a C0 or C1 control */
+        ACT_COLLECT,            /* Private marker or intermediate */
+        ACT_PARAM,              /* Digit or parameter separator */
+        ACT_ESC_DISPATCH,
+        ACT_CSI_DISPATCH,
+        ACT_PUT,                /* Part of a string */
+};
+
+/*
+ * Indexed by state and code point, with everything from U+00A0 up
+ * sharing the last column. The low nibble of each entry is the next
+ * state and the high nibble is the action to take on the way there.
+ */
+extern const uint8_t esc_table[ESC_STATE_MAX][0xa1];
+
+#define ESC_NEXT(e) ((e) & 0xf)
+#define ESC_ACTION(e) ((e) >> 4)
+
+/*
+ * Parameters, private marker, intermediates and final character of
+ * the CSI, DCS or plain escape sequence being parsed. Parameters are
+ * accumulated as the digits come in.
+ */
+struct csi {
         long arg[ESC_ARG_SIZE];
+        bool sub[ESC_ARG_SIZE]; /* `arg[i]` came after a `:` */
         int narg;
+        bool overflow;          /* There were too many parameters */
 
-        bool priv;
+        char priv;              /* One of `<=>?`, or 0 */
+        char inter;             /* The first intermediate, or 0 */
+        int ninter;
 
-        char mode[2];
+        char mode;              /* The final character */
 };
 
 struct stresc {
-        /* TODO: Nor this one. */
+        /* TODO: Don't hard code this buffer size. */
         char buf[2048];
         unsigned len;
 
@@ -28,5 +82,8 @@ struct stresc {
         char type;
 };
 
-void csiparse(struct csi *csi);
+void csiclear(struct csi *csi);
+void csicollect(struct csi *csi, uint32_t c);
+void csiparam(struct csi *csi, uint32_t c);
+void strescput(struct stresc *stresc, uint32_t c);
 void strescparse(struct stresc *stresc);
@@ -61,14 +61,34 @@ int font_manager_init(struct font_manager *m)
         return 0;
 }
 
+static unsigned sprite_hash(uint32_t c, int mode, int font_size)
+{
+        uint32_t h = c * 2654435761u ^ (mode & (FONT_BOLD | FONT_ITALIC)) << 24 ^ font_size * 40503u;
+        return (h ^ h >> 15) & (SPRITE_INDEX_SIZE - 1);
+}
+
+/* Adds the newest sprite to the index and returns it. */
+static struct sprite *index_sprite(struct font_manager *r)
+{
+        struct sprite *s = r->cell + r->num_cell++;
+        unsigned h = sprite_hash(s->c, s->mode, s->font_size);
+
+        while (r->index[h]) h = (h + 1) & (SPRITE_INDEX_SIZE - 1);
+        r->index[h] = r->num_cell;
+
+        return s;
+}
+
 struct sprite *get_sprite(struct font_manager *r, uint32_t c, int mode, int font_size)
 {
-        for (int i = 0; i < r->num_cell; i++) {
-                if (r->cell[i].c == c &&
-                        (r->cell[i].mode & (FONT_BOLD | FONT_ITALIC))
+        for (unsigned h = sprite_hash(c, mode, font_size); r->index[h]; h = (h + 1) & (SPRITE_INDEX_SIZE - 1)) {
+                struct sprite *s = r->cell + r->index[h] - 1;
+
+                if (s->c == c &&
+                        (s->mode & (FONT_BOLD | FONT_ITALIC))
                         == (mode & (FONT_BOLD | FONT_ITALIC))
-                    && r->cell[i].font_size == font_size)
-                        return r->cell + i;
+                    && s->font_size == font_size)
+                        return s;
         }
 
         struct font *font = NULL;
@@ -158,7 +178,7 @@ struct sprite *get_sprite(struct font_manager *r, uint32_t c, int mode, int font
                 };
                 font->num_cell++;
 
-                return &r->cell[r->num_cell++];
+                return index_sprite(r);
         }
 
         /* TODO: Fix this haha. */
@@ -218,7 +238,7 @@ struct sprite *get_sprite(struct font_manager *r, uint32_t c, int mode, int font
         font->spritemap_dirty = 1;
         font->num_cell++;
 
-        return &r->cell[r->num_cell++];
+        return index_sprite(r);
 }
 
 void font_get_dimensions(struct font_manager *m, int *cw, int *ch, int font_size)
@@ -38,10 +38,12 @@ struct font_manager {
         /* FreeType */
         FT_Library ft;
 
-        /* TODO: Use a hashtable for this. */
         struct sprite cell[NUM_CELL];
         int num_cell;
 
+        /* Where each sprite is in `cell`, plus one, by its hash. */
+        int index[SPRITE_INDEX_SIZE];
+
         /* Fonts */
         struct font fonts[MAX_FONTS];
         int num_fonts;
@@ -1,5 +1,7 @@
 #include "global.h"
 
+#include <math.h>                   /* INFINITY */
+
 static struct color color256[256] = {
         { 0.003922, 0.094118, 0.156863 }, /*   0 - #011828 */
         { 0.968627, 0.462745, 0.556863 }, /*   1 - #f7768e */
@@ -270,8 +272,72 @@ int global_init(struct global *k)
         return 0;
 }
 
-int global_render(struct global *f)
+void global_update(struct global *f)
 {
-        window_render(&f->window, &f->font);
-        return 0;
+        /* Only the last of however many resizes came in matters. */
+        if (f->resized) {
+                f->resized = false;
+                window_place(&f->window, 0, 0, f->font.width, f->font.height);
+        }
+
+        if (glfwGetTime() - f->resize_time >= RESIZE_QUIET)
+                window_inform(&f->window);
+
+        f->flushing = window_flush(&f->window);
+
+        /*
+         * Only walk the wterms when the I/O thread said something or
+         * when some shell had more to say than fit in the last frame.
+         */
+        if (platform_poll() || f->backlog)
+                f->backlog = window_update(&f->window);
+}
+
+/*
+ * Whether it's time to catch up and draw: once `1 / MAX_FPS` seconds
+ * have passed since the last frame, or straight away just after a key
+ * was pressed with LATENCY_MODE.
+ */
+bool global_due(struct global *f)
+{
+        double now = glfwGetTime();
+
+        f->late = now < f->frame_time + 1.0 / MAX_FPS
+                && !(LATENCY_MODE && now - f->input_time < 1.0 / MAX_FPS);
+
+        return !f->late;
+}
+
+/* Returns whether anything was drawn, and so whether to swap. */
+bool global_render(struct global *f)
+{
+        if (!window_render(&f->window, &f->font)) return false;
+
+        f->frame_time = glfwGetTime();
+
+        return true;
+}
+
+/*
+ * Sleep until there's something to do. The I/O thread wakes the loop
+ * up when a shell says something and GLFW does for input, so this only
+ * has to come back by itself for the next frame when there's more to
+ * do than fit in the last one, and for a resize settling.
+ */
+void global_wait(struct global *f)
+{
+        double now = glfwGetTime(), until = INFINITY;
+
+        if (f->late || f->backlog || f->flushing)
+                until = f->frame_time + 1.0 / MAX_FPS;
+
+        if (f->resize_time + RESIZE_QUIET > now && f->resize_time + RESIZE_QUIET < until)
+                until = f->resize_time + RESIZE_QUIET;
+
+        if (until == INFINITY)
+                glfwWaitEvents();
+        else if (until > now)
+                glfwWaitEventsTimeout(until - now);
+        else
+                glfwPollEvents();
 }
@@ -18,8 +18,28 @@ struct global {
         struct font_renderer font;
         struct font_manager m;
         GLFWwindow *glfw_window;
+        bool backlog;           /* Some shell has output left to drain */
+        bool flushing;          /* Some shell has input left to take */
+
+        /*
+         * The window has been resized since the last frame, and when
+         * it last was. See `RESIZE_QUIET`.
+         */
+        bool resized;
+        double resize_time;
+
+        /*
+         * When the last frame was drawn and the last key was pressed,
+         * and whether the loop was woken up before the next frame was
+         * due. See `MAX_FPS`.
+         */
+        double frame_time, input_time;
+        bool late;
         /* void (*window_title_callback)(char *); */
 };
 
 int global_init(struct global *k);
-int global_render(struct global *k);
+void global_update(struct global *k);
+bool global_due(struct global *k);
+bool global_render(struct global *k);
+void global_wait(struct global *k);
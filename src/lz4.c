@@ -0,0 +1,153 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz4.h"
+
+/*
+ * A block is a series of sequences, each a run of literal bytes
+ * followed by a match: a copy of earlier output given as an offset
+ * back and a length. A token byte holds both lengths in its nibbles
+ * and 15 means more length bytes follow. The last sequence is only
+ * literals, and the format requires the last 5 bytes to be literals
+ * and the last match to start 12 bytes before the end.
+ */
+
+#define MIN_MATCH 4
+#define LAST_LITERALS 5
+#define MF_LIMIT 12
+#define HASH_LOG 12
+
+static uint32_t read32(const uint8_t *p)
+{
+        uint32_t v;
+        memcpy(&v, p, sizeof v);
+        return v;
+}
+
+static uint32_t hash(uint32_t v)
+{
+        return (v * 2654435761u) >> (32 - HASH_LOG);
+}
+
+/* Writes the rest of a length which didn't fit in its nibble. */
+static uint8_t *put_length(uint8_t *op, size_t len)
+{
+        for (len -= 15; len >= 255; len -= 255) *op++ = 255;
+        *op++ = len;
+        return op;
+}
+
+size_t lz4_compress(const char *src, size_t n, char *dst, size_t cap)
+{
+        const uint8_t *ip = (const uint8_t *)src, *anchor = ip;
+        const uint8_t *base = ip, *end = ip + n;
+        uint8_t *op = (uint8_t *)dst, *oend = op + cap;
+        uint32_t table[1 << HASH_LOG] = { 0 };
+
+        if (n > MF_LIMIT) {
+                const uint8_t *mflimit = end - MF_LIMIT;
+                const uint8_t *matchlimit = end - LAST_LITERALS;
+
+                while (ip < mflimit) {
+                        uint32_t seq = read32(ip), h = hash(seq);
+                        const uint8_t *ref = base + table[h];
+
+                        table[h] = ip - base;
+
+                        if (ref >= ip || ip - ref > 65535 || read32(ref) != seq) {
+                                ip++;
+                                continue;
+                        }
+
+                        const uint8_t *start = ip;
+
+                        for (ip += MIN_MATCH, ref += MIN_MATCH; ip < matchlimit && *ip == *ref; ip++, ref++);
+
+                        size_t lit = start - anchor, len = ip - start - MIN_MATCH;
+
+                        if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit + 2 + len / 255 + 1)
+                                return 0;
+
+                        uint8_t *token = op++;
+
+                        *token = (lit < 15 ? lit : 15) << 4 | (len < 15 ? len : 15);
+                        if (lit >= 15) op = put_length(op, lit);
+                        memcpy(op, anchor, lit);
+                        op += lit;
+
+                        size_t off = ip - ref;
+                        *op++ = off & 0xff;
+                        *op++ = off >> 8;
+
+                        if (len >= 15) op = put_length(op, len);
+
+                        anchor = ip;
+                }
+        }
+
+        size_t lit = end - anchor;
+
+        if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit) return 0;
+
+        *op++ = (lit < 15 ? lit : 15) << 4;
+        if (lit >= 15) op = put_length(op, lit);
+        memcpy(op, anchor, lit);
+        op += lit;
+
+        return op - (uint8_t *)dst;
+}
+
+size_t lz4_decompress(const char *src, size_t n, char *dst, size_t cap)
+{
+        const uint8_t *ip = (const uint8_t *)src, *iend = ip + n;
+        uint8_t *op = (uint8_t *)dst, *oend = op + cap;
+
+        while (ip < iend) {
+                unsigned token = *ip++;
+                size_t lit = token >> 4, len = token & 15;
+                uint8_t b;
+
+                if (lit == 15)
+                        do {
+                                if (ip >= iend) return 0;
+                                lit += b = *ip++;
+                        } while (b == 255);
+
+                if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) return 0;
+
+                memcpy(op, ip, lit);
+                op += lit;
+                ip += lit;
+
+                /* The last sequence has no match. */
+                if (ip == iend) break;
+                if (iend - ip < 2) return 0;
+
+                size_t off = ip[0] | ip[1] << 8;
+                ip += 2;
+
+                if (!off || off > (size_t)(op - (uint8_t *)dst)) return 0;
+
+                if (len == 15)
+                        do {
+                                if (ip >= iend) return 0;
+                                len += b = *ip++;
+                        } while (b == 255);
+
+                len += MIN_MATCH;
+
+                if (len > (size_t)(oend - op)) return 0;
+
+                /* The match may overlap what it's writing. */
+                const uint8_t *ref = op - off;
+
+                if (off >= len) {
+                        memcpy(op, ref, len);
+                        op += len;
+                } else {
+                        while (len--) *op++ = *ref++;
+                }
+        }
+
+        return op - (uint8_t *)dst;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stddef.h>
+
+/*
+ * Compression in the LZ4 block format. It's fast enough to compress
+ * scrollback as it comes in, and the format is simple enough that
+ * there's no need to link against liblz4 for it.
+ */
+
+/* The most `lz4_compress` can produce from `n` bytes. */
+#define LZ4_BOUND(n) ((n) + (n) / 255 + 16)
+
+/*
+ * Compresses `n` bytes of `src` into `dst`, which has room for `cap`
+ * bytes. Returns the compressed size, or 0 if it didn't fit.
+ */
+size_t lz4_compress(const char *src, size_t n, char *dst, size_t cap);
+
+/*
+ * Decompresses `n` bytes of `src` into `dst`. Returns the size of the
+ * output, or 0 if the input is malformed or doesn't fit in `cap`.
+ */
+size_t lz4_decompress(const char *src, size_t n, char *dst, size_t cap);
@@ -24,13 +24,21 @@
 GLFWwindow *window;
 struct global *k;
 
+/* Typing anything brings the view back down from the scrollback. */
+static void type(struct wterm *wt, const char *s, size_t len)
+{
+        wt->term->scroll = 0;
+        platform_write(wt->subprocess, s, len);
+}
+
 void character_callback(GLFWwindow *window, uint32_t c)
 {
         (void)window;
+        k->input_time = glfwGetTime();
         uint8_t buf[4];
         unsigned len = 0;
         utf8encode(c, buf, &len);
-        platform_write(k->focus->subprocess, (char *)buf, len);
+        type(k->focus, (char *)buf, len);
 }
 
 static struct key {
@@ -202,9 +210,16 @@ void key_callback(GLFWwindow *window, int key, int scancode, int action, int mod
 
         if (action == GLFW_RELEASE) return;
 
+        k->input_time = glfwGetTime();
+
         if (key == GLFW_KEY_INSERT && mods & GLFW_MOD_SHIFT) {
-                const char *s = glfwGetClipboardString(window);
-                platform_write(k->focus->subprocess, s, strlen(s));
+                window_paste(k->focus, glfwGetClipboardString(window));
+                return;
+        }
+
+        /* Escape gets you out of a paste you didn't mean to make. */
+        if (key == GLFW_KEY_ESCAPE && k->focus->paste) {
+                window_cancel_paste(k->focus);
                 return;
         }
 
@@ -243,13 +258,24 @@ void key_callback(GLFWwindow *window, int key, int scancode, int action, int mod
          * safe to use these conditionals.
          */
 
+        /*
+         * Shift+PgUp and Shift+PgDn page through the scrollback, except
+         * on the alternate screen where the program running gets them.
+         */
+        if ((key == GLFW_KEY_PAGE_UP || key == GLFW_KEY_PAGE_DOWN)
+            && mods & GLFW_MOD_SHIFT && !(f->term->mode & MODE_ALTSCREEN)) {
+                int n = f->term->g->row;
+                term_scroll(f->term, key == GLFW_KEY_PAGE_UP ? n : -n);
+                return;
+        }
+
         if (key >= 'A' && key <= 'Z' && mods & GLFW_MOD_CONTROL) {
-                platform_write(f->subprocess, (char []){ key - 'A' + 1 }, 1);
+                type(f, (char []){ key - 'A' + 1 }, 1);
                 return;
         }
 
         if (key >= 32 && key <= 126 && mods & GLFW_MOD_ALT) {
-                platform_write(f->subprocess, (char []){ 0x1b, tolower(key) }, 2);
+                type(f, (char []){ 0x1b, tolower(key) }, 2);
                 return;
         }
 
@@ -273,20 +299,30 @@ void key_callback(GLFWwindow *window, int key, int scancode, int action, int mod
 
         if (s) _printf("Key string \e[36m^[%s\e[0m\n", s + 1);
 
-        if (s) platform_write(f->subprocess, s, strlen(s));
+        if (s) type(f, s, strlen(s));
 }
 
 void window_size_callback(GLFWwindow *window, int width, int height)
 {
         (void)window;
         k->font.width = width, k->font.height = height;
-        window_place(&k->window, 0, 0, width, height);
+        k->resized = true;
+        k->resize_time = glfwGetTime();
+}
+
+/* The window was uncovered or some such and has to be drawn again. */
+void window_refresh_callback(GLFWwindow *window)
+{
+        (void)window;
+        k->window.stale = true;
 }
 
 int main(int argc, char **argv)
 {
         (void)argc; /* TODO: Parse arguments. */
 
+        /* The I/O thread only ever calls this once there are shells. */
+        if (platform_init(glfwPostEmptyEvent)) return 1;
         if (!glfwInit()) return 1;
 
         /* TODO: Make the default window size configurable. */
@@ -302,6 +338,7 @@ int main(int argc, char **argv)
         glfwSetCharCallback(window, character_callback);
         glfwSetKeyCallback(window, key_callback);
         glfwSetWindowSizeCallback(window, window_size_callback);
+        glfwSetWindowRefreshCallback(window, window_refresh_callback);
 
         /* Initialize GLEW. */
         GLenum glew_status = glewInit();
@@ -311,8 +348,9 @@ int main(int argc, char **argv)
                 return 1;
         }
 
-        if (!GLEW_VERSION_2_0) {
-                fprintf(stderr, "No support for OpenGL 2.0 found\n");
+        /* Cells are drawn instanced, reading their sprites from a float texture. */
+        if (!GLEW_VERSION_3_3) {
+                fprintf(stderr, "No support for OpenGL 3.3 found\n");
                 return 1;
         }
 
@@ -327,14 +365,21 @@ int main(int argc, char **argv)
         window_spawn(&k->window);
         k->focus = k->window.wterm;
 
+        /* There's no sense waiting for the first size to settle. */
+        window_inform(&k->window);
+
         global_render(k);
 
         glfwSwapBuffers(window);
 
         while (!glfwWindowShouldClose(window) && k->focus) {
-                global_render(k);
-                glfwSwapBuffers(window);
-                glfwPollEvents();
+                if (global_due(k)) {
+                        global_update(k);
+                        if (!k->focus) break;
+                        if (global_render(k)) glfwSwapBuffers(window);
+                }
+
+                global_wait(k);
         }
 
         glfwTerminate();
@@ -0,0 +1,114 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "paste.h"
+#include "platform.h"
+#include "util.h"
+
+#define PASTE_BEGIN "\033[200~"
+#define PASTE_END "\033[201~"
+
+/*
+ * Remove anything that looks like the closing bracket. Otherwise the
+ * clipboard could end the paste early and have the rest of itself run
+ * as if it had been typed. The check is made on the output so that
+ * removing one marker can't leave another one behind.
+ */
+static size_t strip_end_marker(char *buf, size_t len)
+{
+        size_t n = strlen(PASTE_END), in = 0, out = 0;
+
+        while (in < len) {
+                /*
+                 * A marker can only be completed within `n` bytes of
+                 * an escape, so copy everything up to the next one in
+                 * one go when there's none in sight.
+                 */
+                size_t tail = out < n - 1 ? out : n - 1;
+
+                if (!memchr(buf + out - tail, '\033', tail)) {
+                        char *esc = memchr(buf + in, '\033', len - in);
+                        size_t m = (esc ? (size_t)(esc - buf) : len) - in;
+
+                        memmove(buf + out, buf + in, m);
+                        in += m, out += m;
+                        if (in == len) break;
+                }
+
+                buf[out++] = buf[in++];
+                if (out >= n && !memcmp(buf + out - n, PASTE_END, n)) out -= n;
+        }
+
+        return out;
+}
+
+struct paste *paste_start(const char *s, bool bracketed)
+{
+        struct paste *p = calloc(1, sizeof *p);
+        if (!p) return NULL;
+
+        p->len = strlen(s);
+        p->buf = malloc(p->len + 1);
+
+        if (!p->buf) {
+                free(p);
+                return NULL;
+        }
+
+        memcpy(p->buf, s, p->len);
+        p->bracketed = bracketed;
+        if (bracketed) p->len = strip_end_marker(p->buf, p->len);
+
+        return p;
+}
+
+/*
+ * Queue the next part of the paste, keeping no more than
+ * `PASTE_WINDOW` bytes in flight. Returns whether the whole thing has
+ * been queued.
+ */
+bool paste_feed(struct paste *p, struct subprocess *sub)
+{
+        if (p->bracketed && !p->started) {
+                platform_write(sub, PASTE_BEGIN, strlen(PASTE_BEGIN));
+                p->started = true;
+        }
+
+        size_t pending = platform_pending(sub);
+
+        if (pending < PASTE_WINDOW && p->off < p->len) {
+                size_t n = PASTE_WINDOW - pending;
+                if (n > p->len - p->off) n = p->len - p->off;
+                platform_write(sub, p->buf + p->off, n);
+                p->off += n;
+        }
+
+        if (p->off < p->len) return false;
+
+        if (p->bracketed) platform_write(sub, PASTE_END, strlen(PASTE_END));
+
+        return true;
+}
+
+/*
+ * Stop pasting. Whatever was already queued still goes out, and the
+ * bracket is closed so the application isn't left waiting for the end
+ * of the paste.
+ */
+void paste_cancel(struct paste *p, struct subprocess *sub)
+{
+        if (p->started) platform_write(sub, PASTE_END, strlen(PASTE_END));
+        _printf("Cancelled paste after %zu of %zu bytes\n", p->off, p->len);
+}
+
+float paste_progress(struct paste *p)
+{
+        return p->len ? (float)p->off / (float)p->len : 1;
+}
+
+void paste_free(struct paste *p)
+{
+        if (!p) return;
+        free(p->buf);
+        free(p);
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct subprocess;
+
+/*
+ * A paste in progress. The clipboard is copied once and then fed to
+ * the shell a piece at a time, only as fast as the shell takes it, so
+ * a huge paste neither freezes the terminal nor buries the shell in
+ * input it hasn't asked for yet.
+ */
+struct paste {
+        char *buf;
+        size_t len, off;
+        bool bracketed;         /* Wrap it in \e[200~ ... \e[201~ */
+        bool started;           /* The opening bracket has been sent */
+};
+
+struct paste *paste_start(const char *s, bool bracketed);
+bool paste_feed(struct paste *p, struct subprocess *sub);
+void paste_cancel(struct paste *p, struct subprocess *sub);
+float paste_progress(struct paste *p);
+void paste_free(struct paste *p);
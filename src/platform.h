@@ -1,13 +1,33 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 
 struct subprocess;
 
+/*
+ * Counters kept by the PTY reader, for tuning the read size and the
+ * coalescing window. `reads / commits` is how many reads were merged
+ * into each chunk handed to the terminal on average, and `stalls` is
+ * how often the reader stopped because the terminal fell behind.
+ */
+struct pty_stats {
+        unsigned long reads, bytes, commits, stalls;
+        unsigned long grows, shrinks, read_size, max_read_size;
+};
+
+int platform_init(void (*wakeup)(void));
+bool platform_poll(void);
+int platform_wakeup_fd(void);
 struct subprocess *platform_spawn_shell(void *fluff,
                                         int (*callback)(void *, char *, int),
                                         void (*end)(void *));
+size_t platform_drain(struct subprocess *p, size_t budget);
+void platform_get_stats(struct subprocess *p, struct pty_stats *s);
 int platform_write(struct subprocess *p, const char *buf, int n);
-void platform_close_shell(void);
+size_t platform_flush(struct subprocess *p);
+size_t platform_pending(struct subprocess *p);
+void platform_close_shell(struct subprocess *p);
 void platform_inform_subprocess_of_resize(struct subprocess *p, int col, int row);
 FILE *platform_open_config(void);
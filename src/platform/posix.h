@@ -1,12 +1,26 @@
 #define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE
 
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <poll.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "../ring.h"
+#include "../util.h"
+#include "../platform.h"
 
 extern char **environ;
 
@@ -14,41 +28,552 @@ struct subprocess {
         int master;
 
         /*
-         * Each shell forks off into a different process and we spawn
-         * a thread which just waits for it to say something. Then it
-         * repeats whatever the shell said to the terminal by calling
-         * the `write` callback.
+         * Each shell forks off into a different process. A single I/O
+         * thread (see `io_thread` and `uring_thread`) waits on all of
+         * them at once and copies whatever they say into their `ring`.
+         * It never touches the terminal; the main thread drains the ring with
+         * `platform_drain` before it renders, so the terminal state is
+         * only ever touched from one thread.
          */
-        pthread_t thread;
+        struct ring ring;
+
+        /* Set by the I/O thread once the shell has gone away. */
+        atomic_bool dead;
+
+        /*
+         * Set by the I/O thread when it stopped watching `master`
+         * because the ring is full. The main thread kicks the I/O
+         * thread once it has made room again.
+         */
+        atomic_bool paused;
+        struct subprocess *next_paused; /* Only touched by the I/O thread. */
+
+        /*
+         * How much the I/O thread asks for per `readv`. It grows
+         * while reads keep coming back full and shrinks when they
+         * come back mostly empty.
+         */
+        size_t read_size;
+
+        /*
+         * io_uring only: the fixed buffer slot `ring` is registered
+         * in (or -1), the size of the read in flight, and the link in
+         * `io.added`.
+         */
+        int slot;
+        size_t want;
+        struct subprocess *next_added;
+
+        /* What `master` is in the epoll set for, or 0. */
+        uint32_t events;
+
+        /*
+         * Input for the shell. `platform_write` only appends to
+         * `pending`, which belongs to the main thread, and
+         * `platform_flush` moves as much of it as fits into `out` once
+         * per frame. The I/O thread writes `out` to `master` without
+         * ever blocking. `flushing` is set while the I/O thread is
+         * responsible for emptying `out`.
+         */
+        char *pending;
+        size_t pending_off, pending_len, pending_cap;
+        struct ring out;
+        atomic_bool flushing;
+        struct subprocess *next_flush;
+
+        /* Written by the I/O thread, see `platform_get_stats`. */
+        struct {
+                atomic_ulong reads, bytes, commits, stalls;
+                atomic_ulong grows, shrinks, read_size, max_read_size;
+        } stats;
 
         /*
          * `write` is a callback which is called whenever the shell
          * wants to say something to the terminal. `fluff` is the
-         * terminal being written to (well, the wterm).
+         * terminal being written to (well, the wterm). Both `write`
+         * and `end` are called from the main thread.
          */
         void *fluff;
         int (*write)(void *, char *, int);
         void (*end)(void *);
+        bool ended;
+
+        /*
+         * Only touched by the I/O thread: whether the main thread has
+         * closed it, and whether an io_uring write for it is still in
+         * flight. It's freed once both are done with it.
+         */
+        bool closed, writing;
+        struct subprocess *next_closed;
 };
 
-static void *read_shell(void *arg)
+/*
+ * The I/O thread. `epoll` watches the master side of every PTY plus
+ * `wake`, which the main thread uses to get the I/O thread's
+ * attention. `notify` goes the other way: it's bumped once per batch
+ * of reads so the render loop knows there's something to drain.
+ */
+static struct {
+        pthread_t thread;
+        bool uring;             /* Whether `uring_thread` is running */
+        int epoll;
+        int wake;
+        int notify;
+        void (*wakeup)(void);   /* Called along with `notify` */
+
+        /* Subprocesses which aren't being watched right now. */
+        struct subprocess *paused;
+
+        /*
+         * Subprocesses handed over by the main thread: new ones, and
+         * ones with fresh input in `out`. Only the I/O thread touches
+         * the epoll set or the submission ring.
+         */
+        _Atomic(struct subprocess *) added;
+        _Atomic(struct subprocess *) flush;
+        _Atomic(struct subprocess *) closed;
+
+        /* Closed subprocesses to free at the end of the batch. */
+        struct subprocess *doomed;
+} io;
+
+#define STAT_ADD(p, x, n) atomic_fetch_add_explicit(&(p)->stats.x, (n), memory_order_relaxed)
+#define STAT_SET(p, x, n) atomic_store_explicit(&(p)->stats.x, (n), memory_order_relaxed)
+
+static long elapsed_ns(const struct timespec *start)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (now.tv_sec - start->tv_sec) * 1000000000L
+                + now.tv_nsec - start->tv_nsec;
+}
+
+/*
+ * The most one read of a PTY ever returns on Linux, however much is
+ * asked for: the line discipline hands over at most what fits in its
+ * own 4 KiB buffer.
+ */
+#define PTY_READ_CHUNK 4095
+
+/*
+ * Adjust the read size based on how the last read went. A read which
+ * got all it could, either the whole request or as much as the PTY
+ * ever gives at once, means there's probably a lot more where that
+ * came from.
+ */
+static void adapt_read_size(struct subprocess *p, size_t want, size_t got)
+{
+        size_t full = want < PTY_READ_CHUNK ? want : PTY_READ_CHUNK;
+
+        if (want == p->read_size && got >= full && p->read_size < PTY_READ_MAX) {
+                p->read_size *= 2;
+                STAT_ADD(p, grows, 1);
+        } else if (got < full / 4 && p->read_size > PTY_READ_MIN) {
+                p->read_size /= 2;
+                STAT_ADD(p, shrinks, 1);
+        }
+
+        STAT_SET(p, read_size, p->read_size);
+        if (p->read_size > atomic_load_explicit(&p->stats.max_read_size, memory_order_relaxed))
+                STAT_SET(p, max_read_size, p->read_size);
+}
+
+static void wake_io(void)
+{
+        if (write(io.wake, &(uint64_t){ 1 }, sizeof(uint64_t)) == -1)
+                perror("write");
+}
+
+/*
+ * Change what `master` is watched for, adding it to or removing it
+ * from the epoll set as needed.
+ */
+static void set_events(struct subprocess *p, uint32_t events)
+{
+        if (events == p->events) return;
+
+        struct epoll_event ev = { .events = events, .data.ptr = p };
+        int op = !p->events ? EPOLL_CTL_ADD : !events ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+
+        if (epoll_ctl(io.epoll, op, p->master, &ev) == -1)
+                perror("epoll_ctl");
+
+        p->events = events;
+}
+
+static void watch(struct subprocess *p)
+{
+        set_events(p, p->events | EPOLLIN);
+}
+
+static bool uring_read(struct subprocess *p);
+static void uring_start(struct subprocess *p);
+static void uring_write(struct subprocess *p);
+static void uring_unregister_buffer(struct subprocess *p);
+
+/*
+ * Start watching `p` again if the terminal has made enough room in
+ * its ring. Returns whether it was resumed.
+ */
+static bool try_resume(struct subprocess *p)
+{
+        if (ring_space(&p->ring) < PTY_READ_MIN) return false;
+        atomic_store(&p->paused, false);
+        if (io.uring) uring_read(p);
+        else watch(p);
+        return true;
+}
+
+/*
+ * The terminal has fallen behind. Stop reading from `p` and let the
+ * kernel's PTY buffer fill up so that the shell blocks instead of
+ * us. Unless we're also waiting to write, the descriptor is removed
+ * from the epoll set rather than just masked because a hangup would
+ * still be reported otherwise.
+ */
+static void pause_subprocess(struct subprocess *p)
 {
-        struct subprocess *p = (struct subprocess *)arg;
+        if (!io.uring) set_events(p, p->events & ~EPOLLIN);
+        STAT_ADD(p, stalls, 1);
+
+        /*
+         * Pairs with the fence in `platform_drain`: either the main
+         * thread sees `paused` and kicks us, or we see the room it
+         * made here.
+         */
+        atomic_store(&p->paused, true);
+        atomic_thread_fence(memory_order_seq_cst);
+
+        if (try_resume(p)) return;
+
+        p->next_paused = io.paused;
+        io.paused = p;
+}
+
+static void resume_subprocesses(void)
+{
+        struct subprocess **p = &io.paused;
+
+        while (*p) {
+                if (try_resume(*p)) *p = (*p)->next_paused;
+                else p = &(*p)->next_paused;
+        }
+}
+
+/*
+ * `out` looks empty. Give up responsibility for it, unless the main
+ * thread slipped more in before it could see that we were done.
+ * Returns whether there's more to write.
+ */
+static bool finish_flush(struct subprocess *p)
+{
+        atomic_store(&p->flushing, false);
+
+        /* Pairs with the fence in `platform_flush`. */
+        atomic_thread_fence(memory_order_seq_cst);
+
+        return ring_used(&p->out) && !atomic_exchange(&p->flushing, true);
+}
+
+/*
+ * Read everything `p` has to say right now into its ring. Reads are
+ * committed together so the main thread sees one big chunk instead
+ * of many small ones, but no single subprocess gets to hog the I/O
+ * thread for longer than `PTY_COALESCE_NS`. Returns whether anything
+ * happened that the main thread needs to know about.
+ */
+static bool read_subprocess(struct subprocess *p)
+{
+        size_t pending = 0;
+        struct timespec start;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        while (elapsed_ns(&start) < PTY_COALESCE_NS) {
+                char *a, *b;
+                size_t alen, blen;
+                size_t space = ring_write_span(&p->ring, pending, &a, &alen, &b, &blen);
+
+                if (space < PTY_READ_MIN) {
+                        if (pending) break;
+                        pause_subprocess(p);
+                        return false;
+                }
+
+                size_t want = space < p->read_size ? space : p->read_size;
+
+                struct iovec iov[2] = {
+                        { a, alen < want ? alen : want },
+                        { b, alen < want ? want - alen : 0 },
+                };
 
-        char buf[BUFSIZ];
+                ssize_t ret = readv(p->master, iov, iov[1].iov_len ? 2 : 1);
 
+                if (ret == -1 && errno == EINTR) continue;
+                if (ret == -1 && errno == EAGAIN) break;
+
+                /* The shell has exited (Linux says EIO here). */
+                if (ret <= 0) {
+                        set_events(p, 0);
+                        if (pending) ring_commit(&p->ring, pending);
+                        atomic_store_explicit(&p->dead, true, memory_order_release);
+                        return true;
+                }
+
+                pending += ret;
+
+                STAT_ADD(p, reads, 1);
+                STAT_ADD(p, bytes, ret);
+                adapt_read_size(p, want, ret);
+        }
+
+        if (!pending) return false;
+
+        ring_commit(&p->ring, pending);
+        STAT_ADD(p, commits, 1);
+
+        return true;
+}
+
+/*
+ * Write as much of `p`'s input as the PTY will take. Once it won't
+ * take any more, wait for EPOLLOUT instead of blocking.
+ */
+static void write_subprocess(struct subprocess *p)
+{
         while (1) {
-                int ret = read(p->master, buf, sizeof buf);
-                if (ret <= 0) break;
-                int written = p->write(p->fluff, buf, ret);
-                if (written < 0) break;
+                size_t len;
+                char *buf = ring_read_ptr(&p->out, &len);
+
+                if (!len) {
+                        if (finish_flush(p)) continue;
+                        break;
+                }
+
+                ssize_t ret = write(p->master, buf, len);
+
+                if (ret == -1 && errno == EINTR) continue;
+
+                if (ret == -1 && errno == EAGAIN) {
+                        set_events(p, p->events | EPOLLOUT);
+                        return;
+                }
+
+                /* The shell is gone, and so is its input. */
+                if (ret <= 0) ret = len;
+
+                ring_consume(&p->out, ret);
+        }
+
+        if (!atomic_load_explicit(&p->dead, memory_order_relaxed))
+                set_events(p, p->events & ~EPOLLOUT);
+}
+
+/*
+ * Let go of `p`, which the main thread has closed. Nothing can refer
+ * to it by now except an event later in the same batch, so it's only
+ * put on `io.doomed` here and freed by `free_closed`.
+ */
+static void close_subprocess(struct subprocess *p)
+{
+        struct subprocess **q = &io.paused;
+
+        while (*q && *q != p) q = &(*q)->next_paused;
+        if (*q) *q = p->next_paused;
+
+        if (io.uring) uring_unregister_buffer(p);
+        else set_events(p, 0);
+
+        p->closed = true;
+
+        /* The completion of the write frees it instead. */
+        if (p->writing) return;
+
+        p->next_closed = io.doomed;
+        io.doomed = p;
+}
+
+static void free_closed(void)
+{
+        struct subprocess *p, *next;
+
+        for (p = io.doomed; p; p = next) {
+                next = p->next_closed;
+                close(p->master);
+                ring_free(&p->ring);
+                ring_free(&p->out);
+                free(p);
         }
 
-        p->end(p->fluff);
+        io.doomed = NULL;
+}
+
+/*
+ * The main thread wants our attention: pick up new subprocesses,
+ * resume the ones the terminal has made room for, start writing out
+ * any input that was flushed and let go of the ones that were closed.
+ * The closed ones are taken first but let go of last, since anything
+ * the main thread handed over before closing one has to be dealt
+ * with before it's gone.
+ */
+static void handle_wake(void)
+{
+        uint64_t x;
+
+        if (read(io.wake, &x, sizeof x) == -1 && errno != EAGAIN)
+                perror("read");
+
+        struct subprocess *p, *next;
+        struct subprocess *closed = atomic_exchange(&io.closed, NULL);
+
+        for (p = atomic_exchange(&io.added, NULL); p; p = next) {
+                next = p->next_added;
+                if (io.uring) uring_start(p);
+                else watch(p);
+        }
+
+        resume_subprocesses();
+
+        for (p = atomic_exchange(&io.flush, NULL); p; p = next) {
+                next = p->next_flush;
+                if (io.uring) uring_write(p);
+                else write_subprocess(p);
+        }
+
+        for (p = closed; p; p = next) {
+                next = p->next_closed;
+                close_subprocess(p);
+        }
+}
+
+/*
+ * Let the main thread know there's something to drain, waking the
+ * render loop up if it's asleep.
+ */
+static void notify_main(void)
+{
+        if (write(io.notify, &(uint64_t){ 1 }, sizeof(uint64_t)) == -1)
+                perror("write");
+        if (io.wakeup) io.wakeup();
+}
+
+static void *io_thread(void *arg)
+{
+        (void)arg;
+        struct epoll_event ev[64];
+
+        while (1) {
+                int n = epoll_wait(io.epoll, ev, sizeof ev / sizeof *ev, -1);
+
+                if (n == -1) {
+                        if (errno == EINTR) continue;
+                        perror("epoll_wait");
+                        break;
+                }
+
+                bool notify = false;
+
+                for (int i = 0; i < n; i++) {
+                        struct subprocess *p = ev[i].data.ptr;
+
+                        if (!p) {
+                                handle_wake();
+                                continue;
+                        }
+
+                        if (ev[i].events & EPOLLOUT)
+                                write_subprocess(p);
+
+                        /*
+                         * A paused subprocess is only still in the set
+                         * because it has input waiting, so leave any
+                         * hangup to `write_subprocess`.
+                         */
+                        if (p->events & EPOLLIN && ev[i].events & ~EPOLLOUT)
+                                notify |= read_subprocess(p);
+                }
+
+                /* One wakeup for the whole batch. */
+                if (notify) notify_main();
+
+                free_closed();
+        }
 
         return NULL;
 }
 
+#include "uring.h"
+
+/*
+ * Start the I/O thread. io_uring is used when the kernel lets us,
+ * otherwise epoll. `wakeup` is called from the I/O thread whenever
+ * there's something for `platform_poll` to see, so that the render
+ * loop can sleep until then.
+ */
+int platform_init(void (*wakeup)(void))
+{
+        io.wakeup = wakeup;
+        io.wake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        io.notify = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+        if (io.wake == -1 || io.notify == -1) {
+                perror("eventfd");
+                return 1;
+        }
+
+        io.uring = uring_init();
+
+        if (!io.uring) {
+                io.epoll = epoll_create1(EPOLL_CLOEXEC);
+
+                struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+
+                if (io.epoll == -1 || epoll_ctl(io.epoll, EPOLL_CTL_ADD, io.wake, &ev) == -1) {
+                        perror("epoll");
+                        return 1;
+                }
+        }
+
+        fprintf(stderr, "kty: reading PTYs with %s\n", io.uring ? "io_uring" : "epoll");
+
+        if (pthread_create(&io.thread, NULL, io.uring ? uring_thread : io_thread, NULL)) {
+                perror("pthread_create");
+                return 1;
+        }
+
+        return 0;
+}
+
+/*
+ * Returns whether the I/O thread has read anything (or seen a shell
+ * exit) since the last call. The render loop can also wait on
+ * `platform_wakeup_fd` directly.
+ */
+bool platform_poll(void)
+{
+        uint64_t x;
+        return read(io.notify, &x, sizeof x) == sizeof x;
+}
+
+int platform_wakeup_fd(void)
+{
+        return io.notify;
+}
+
+void platform_get_stats(struct subprocess *p, struct pty_stats *s)
+{
+#define STAT_GET(x) s->x = atomic_load_explicit(&p->stats.x, memory_order_relaxed)
+        STAT_GET(reads);
+        STAT_GET(bytes);
+        STAT_GET(commits);
+        STAT_GET(stalls);
+        STAT_GET(grows);
+        STAT_GET(shrinks);
+        STAT_GET(read_size);
+        STAT_GET(max_read_size);
+#undef STAT_GET
+}
+
 static int spawn_shell(const char *shell)
 {
         int master = posix_openpt(O_RDWR | O_NOCTTY);
@@ -113,28 +638,162 @@ static int spawn_shell(const char *shell)
         return master;
 }
 
+/*
+ * Hand at most `budget` bytes of whatever the shell has said since
+ * the last call to the terminal. This must only be called from the
+ * main thread. Returns the number of bytes that were handed over.
+ */
+size_t platform_drain(struct subprocess *p, size_t budget)
+{
+        size_t done = 0;
+
+        if (p->ended) return 0;
+
+        /*
+         * Check for death before looking at the ring. Everything the
+         * I/O thread committed happens before it sets `dead`, so if
+         * the ring is empty after seeing `dead` then it's empty for
+         * good.
+         */
+        bool dead = atomic_load_explicit(&p->dead, memory_order_acquire);
+
+        while (done < budget) {
+                size_t len;
+                char *buf = ring_read_ptr(&p->ring, &len);
+                if (!len) break;
+                if (len > budget - done) len = budget - done;
+                p->write(p->fluff, buf, len);
+                ring_consume(&p->ring, len);
+                done += len;
+        }
+
+        /* See `pause_subprocess`. */
+        atomic_thread_fence(memory_order_seq_cst);
+
+        if (atomic_load(&p->paused) && ring_space(&p->ring) >= PTY_READ_MIN)
+                wake_io();
+
+        if (dead && !ring_used(&p->ring)) {
+#ifdef DEBUG
+                struct pty_stats st;
+                platform_get_stats(p, &st);
+                _printf("%lu bytes in %lu reads, %lu commits, %lu stalls, "
+                        "read size %lu (max %lu, %lu grows, %lu shrinks)\n",
+                        st.bytes, st.reads, st.commits, st.stalls,
+                        st.read_size, st.max_read_size, st.grows, st.shrinks);
+#endif
+                p->ended = true;
+                p->end(p->fluff);
+        }
+
+        return done;
+}
+
+/*
+ * Queue `buf` to be written to the shell. Nothing is written until
+ * the next `platform_flush`, so everything typed within a frame goes
+ * out together. This never blocks and never drops anything.
+ */
 int platform_write(struct subprocess *p, const char *buf, int n)
 {
-        return write(p->master, buf, n);
+        if (n <= 0) return 0;
+
+        if (p->pending_off && p->pending_off == p->pending_len)
+                p->pending_off = p->pending_len = 0;
+
+        if (p->pending_len + n > p->pending_cap) {
+                size_t cap = p->pending_cap ? p->pending_cap : BUFSIZ;
+                while (cap < p->pending_len + n) cap *= 2;
+
+                char *pending = realloc(p->pending, cap);
+                if (!pending) return -1;
+
+                p->pending = pending;
+                p->pending_cap = cap;
+        }
+
+        memcpy(p->pending + p->pending_len, buf, n);
+        p->pending_len += n;
+
+        return n;
+}
+
+/*
+ * Move as much queued input as fits into the ring the I/O thread
+ * writes from and make sure it's being written. Called once per frame.
+ * Returns the number of bytes still queued.
+ */
+size_t platform_flush(struct subprocess *p)
+{
+        if (p->pending_off == p->pending_len) return 0;
+
+        /* Nobody is listening anymore. */
+        if (atomic_load_explicit(&p->dead, memory_order_relaxed)) {
+                p->pending_off = p->pending_len = 0;
+                return 0;
+        }
+
+        size_t n = ring_put(&p->out, p->pending + p->pending_off,
+                            p->pending_len - p->pending_off);
+        p->pending_off += n;
+
+        /* See `finish_flush`. */
+        atomic_thread_fence(memory_order_seq_cst);
+
+        if (n && !atomic_exchange(&p->flushing, true)) {
+                p->next_flush = atomic_load(&io.flush);
+                while (!atomic_compare_exchange_weak(&io.flush, &p->next_flush, p));
+                wake_io();
+        }
+
+        return p->pending_len - p->pending_off;
+}
+
+/* How much input hasn't made it to the shell yet. */
+size_t platform_pending(struct subprocess *p)
+{
+        return p->pending_len - p->pending_off + ring_used(&p->out);
 }
 
 struct subprocess *platform_spawn_shell(void *fluff,
                                         int (*callback)(void *, char *, int),
                                         void (*end)(void *))
 {
-        struct subprocess *subprocess = malloc(sizeof *subprocess);
+        struct subprocess *subprocess = calloc(1, sizeof *subprocess);
         subprocess->master = spawn_shell(getenv("SHELL"));
         subprocess->write = callback;
         subprocess->end = end;
         subprocess->fluff = fluff;
-        pthread_create(&subprocess->thread, NULL, read_shell, subprocess);
+        subprocess->read_size = PTY_READ_MIN;
+        ring_init(&subprocess->ring, PTY_RING_SIZE);
+        ring_init(&subprocess->out, PTY_WRITE_RING_SIZE);
+
+        /*
+         * io_uring honours O_NONBLOCK by failing reads with EAGAIN, so
+         * the master only becomes non-blocking for epoll.
+         */
+        if (!io.uring)
+                fcntl(subprocess->master, F_SETFL, fcntl(subprocess->master, F_GETFL) | O_NONBLOCK);
+
+        subprocess->next_added = atomic_load(&io.added);
+        while (!atomic_compare_exchange_weak(&io.added, &subprocess->next_added, subprocess));
+        wake_io();
+
         return subprocess;
 }
 
+/*
+ * Hand `p` back to the I/O thread to be freed. This must only be
+ * called from the main thread once the shell has ended, and `p` must
+ * not be touched afterwards.
+ */
 void platform_close_shell(struct subprocess *p)
 {
-        /* TODO */
-        (void)p;
+        free(p->pending);
+
+        p->next_closed = atomic_load(&io.closed);
+        while (!atomic_compare_exchange_weak(&io.closed, &p->next_closed, p));
+        wake_io();
 }
 
 FILE *platform_open_config(void)
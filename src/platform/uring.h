@@ -0,0 +1,372 @@
+/*
+ * An io_uring backend for the I/O thread. This is included by
+ * `posix.h` and uses its `struct subprocess` and `io` state.
+ *
+ * Instead of waiting for readiness and then calling `readv` for each
+ * shell, a `READ_FIXED` is kept in flight for every shell, aimed
+ * straight at the free space in its ring. Each ring is registered
+ * with the kernel as a fixed buffer so it doesn't have to be mapped
+ * and pinned on every read. Reads for all shells are submitted and
+ * reaped with a single `io_uring_enter` per batch.
+ *
+ * Multishot reads would save the SQE per read, but they only work
+ * with buffers the kernel picks from a provided-buffer ring, and then
+ * every chunk would have to be copied into our ring again.
+ *
+ * liburing isn't required; the handful of syscalls are made directly.
+ */
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* How many rings can be registered as fixed buffers at once. */
+#define URING_BUFFERS 64
+
+#define URING_WAKE 0            /* `user_data` of the poll on `io.wake` */
+#define URING_OUT 1             /* Set in `user_data` for writes */
+
+static struct {
+        int fd;
+
+        unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+        unsigned *cq_head, *cq_tail, *cq_mask;
+        struct io_uring_sqe *sqes;
+        struct io_uring_cqe *cqes;
+        unsigned sq_entries;
+        unsigned to_submit;
+
+        /* Which fixed buffer slots are taken. */
+        bool slot[URING_BUFFERS];
+} uring;
+
+static int uring_enter(unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+        return syscall(__NR_io_uring_enter, uring.fd, to_submit,
+                       min_complete, flags, NULL, 0);
+}
+
+static int uring_register(unsigned op, void *arg, unsigned nr)
+{
+        return syscall(__NR_io_uring_register, uring.fd, op, arg, nr);
+}
+
+static bool uring_supports(struct io_uring_probe *probe, int op)
+{
+        return op <= probe->last_op && probe->ops[op].flags & IO_URING_OP_SUPPORTED;
+}
+
+/*
+ * Set up the ring. Returns false if io_uring is unavailable for any
+ * reason (old kernel, seccomp, disabled by sysctl...), in which case
+ * the caller should fall back to epoll.
+ */
+static bool uring_init(void)
+{
+        struct io_uring_params params = { 0 };
+
+        uring.fd = syscall(__NR_io_uring_setup, 256, &params);
+        if (uring.fd < 0) return false;
+
+        size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+                sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+
+        char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+        if (sq == MAP_FAILED) goto fail;
+
+        char *cq = sq;
+
+        if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+                cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_CQ_RING);
+                if (cq == MAP_FAILED) goto fail;
+        }
+
+        uring.sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                          PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          uring.fd, IORING_OFF_SQES);
+        if (uring.sqes == MAP_FAILED) goto fail;
+
+        uring.sq_head = (unsigned *)(sq + params.sq_off.head);
+        uring.sq_tail = (unsigned *)(sq + params.sq_off.tail);
+        uring.sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+        uring.sq_array = (unsigned *)(sq + params.sq_off.array);
+        uring.cq_head = (unsigned *)(cq + params.cq_off.head);
+        uring.cq_tail = (unsigned *)(cq + params.cq_off.tail);
+        uring.cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+        uring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+        uring.sq_entries = params.sq_entries;
+
+        /* Make sure the kernel knows every opcode we're going to use. */
+        size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+        struct io_uring_probe *probe = calloc(1, probe_size);
+
+        if (!probe || uring_register(IORING_REGISTER_PROBE, probe, 256) < 0
+            || !uring_supports(probe, IORING_OP_READ_FIXED)
+            || !uring_supports(probe, IORING_OP_READ)
+            || !uring_supports(probe, IORING_OP_WRITE)
+            || !uring_supports(probe, IORING_OP_POLL_ADD)) {
+                free(probe);
+                goto fail;
+        }
+
+        free(probe);
+
+        /* Start with an empty table of fixed buffers. */
+        struct io_uring_rsrc_register reg = {
+                .nr = URING_BUFFERS,
+                .flags = IORING_RSRC_REGISTER_SPARSE,
+        };
+
+        if (uring_register(IORING_REGISTER_BUFFERS2, &reg, sizeof reg) < 0)
+                goto fail;
+
+        return true;
+
+fail:
+        close(uring.fd);
+        uring.fd = -1;
+        return false;
+}
+
+/*
+ * Get a fresh SQE. We're the only thread which ever submits, so the
+ * tail only needs to be published to the kernel.
+ */
+static struct io_uring_sqe *uring_sqe(void)
+{
+        unsigned tail = *uring.sq_tail;
+
+        if (tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE) == uring.sq_entries) {
+                uring_enter(uring.to_submit, 0, 0);
+                uring.to_submit = 0;
+        }
+
+        unsigned idx = tail & *uring.sq_mask;
+        struct io_uring_sqe *sqe = uring.sqes + idx;
+
+        memset(sqe, 0, sizeof *sqe);
+        uring.sq_array[idx] = idx;
+        __atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+        uring.to_submit++;
+
+        return sqe;
+}
+
+/*
+ * Register `p`'s ring as a fixed buffer. Registered memory is pinned
+ * and counts against RLIMIT_MEMLOCK, so this can fail; reads for `p`
+ * then just use plain `READ`.
+ */
+static void uring_register_buffer(struct subprocess *p)
+{
+        p->slot = -1;
+
+        for (int i = 0; i < URING_BUFFERS; i++) {
+                if (uring.slot[i]) continue;
+
+                struct iovec iov = { p->ring.buf, p->ring.size };
+                struct io_uring_rsrc_update2 up = {
+                        .offset = i,
+                        .data = (uint64_t)(uintptr_t)&iov,
+                        .nr = 1,
+                };
+
+                if (uring_register(IORING_REGISTER_BUFFERS_UPDATE, &up, sizeof up) < 0)
+                        return;
+
+                uring.slot[i] = true;
+                p->slot = i;
+                return;
+        }
+}
+
+static void uring_unregister_buffer(struct subprocess *p)
+{
+        if (p->slot < 0) return;
+
+        struct iovec iov = { NULL, 0 };
+        struct io_uring_rsrc_update2 up = {
+                .offset = p->slot,
+                .data = (uint64_t)(uintptr_t)&iov,
+                .nr = 1,
+        };
+
+        uring_register(IORING_REGISTER_BUFFERS_UPDATE, &up, sizeof up);
+        uring.slot[p->slot] = false;
+        p->slot = -1;
+}
+
+static void uring_poll_wake(void)
+{
+        struct io_uring_sqe *sqe = uring_sqe();
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = io.wake;
+        sqe->poll32_events = POLLIN;
+        sqe->user_data = URING_WAKE;
+}
+
+/*
+ * Queue a read of up to `p->read_size` bytes into the free space of
+ * `p`'s ring. Returns false without queueing anything if there isn't
+ * enough room.
+ */
+static bool uring_read(struct subprocess *p)
+{
+        size_t len;
+        char *buf = ring_write_ptr(&p->ring, &len);
+
+        if (ring_space(&p->ring) < PTY_READ_MIN) return false;
+        if (len > p->read_size) len = p->read_size;
+
+        struct io_uring_sqe *sqe = uring_sqe();
+        sqe->opcode = p->slot < 0 ? IORING_OP_READ : IORING_OP_READ_FIXED;
+        sqe->fd = p->master;
+        sqe->addr = (uint64_t)(uintptr_t)buf;
+        sqe->len = len;
+        sqe->off = (uint64_t)-1;
+        sqe->buf_index = p->slot < 0 ? 0 : p->slot;
+        sqe->user_data = (uint64_t)(uintptr_t)p;
+        p->want = len;
+
+        return true;
+}
+
+/*
+ * A read for `p` has completed. Returns whether anything happened
+ * that the main thread needs to know about.
+ */
+static bool uring_complete_read(struct subprocess *p, int res)
+{
+        if (res == -EINTR || res == -EAGAIN) {
+                uring_read(p);
+                return false;
+        }
+
+        /* The shell has exited (Linux says EIO here). */
+        if (res <= 0) {
+                uring_unregister_buffer(p);
+                atomic_store_explicit(&p->dead, true, memory_order_release);
+                return true;
+        }
+
+        ring_commit(&p->ring, res);
+
+        STAT_ADD(p, reads, 1);
+        STAT_ADD(p, bytes, res);
+        STAT_ADD(p, commits, 1);
+        adapt_read_size(p, p->want, res);
+
+        if (!uring_read(p)) pause_subprocess(p);
+
+        return true;
+}
+
+static void uring_start(struct subprocess *p)
+{
+        uring_register_buffer(p);
+        if (!uring_read(p)) pause_subprocess(p);
+}
+
+/*
+ * Queue a write of whatever is waiting in `p`'s `out` ring. There's
+ * at most one in flight per subprocess; its completion queues the
+ * next one.
+ */
+static void uring_write(struct subprocess *p)
+{
+        size_t len;
+        char *buf = ring_read_ptr(&p->out, &len);
+
+        if (!len) {
+                if (!finish_flush(p)) return;
+                buf = ring_read_ptr(&p->out, &len);
+        }
+
+        struct io_uring_sqe *sqe = uring_sqe();
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = p->master;
+        sqe->addr = (uint64_t)(uintptr_t)buf;
+        sqe->len = len;
+        sqe->off = (uint64_t)-1;
+        sqe->user_data = (uint64_t)(uintptr_t)p | URING_OUT;
+        p->writing = true;
+}
+
+static void uring_complete_write(struct subprocess *p, int res)
+{
+        p->writing = false;
+
+        /* Whatever is left of its input can go with it. */
+        if (p->closed) {
+                p->next_closed = io.doomed;
+                io.doomed = p;
+                return;
+        }
+
+        if (res == -EINTR || res == -EAGAIN) {
+                res = 0;
+        } else if (res < 0) {
+                /* The shell is gone, and so is its input. */
+                size_t len;
+                ring_read_ptr(&p->out, &len);
+                res = len;
+        }
+
+        ring_consume(&p->out, res);
+        uring_write(p);
+}
+
+static void *uring_thread(void *arg)
+{
+        (void)arg;
+
+        uring_poll_wake();
+
+        while (1) {
+                int ret = uring_enter(uring.to_submit, 1, IORING_ENTER_GETEVENTS);
+
+                if (ret < 0 && errno != EINTR) {
+                        perror("io_uring_enter");
+                        break;
+                }
+
+                if (ret >= 0) uring.to_submit = 0;
+
+                bool notify = false;
+                unsigned head = *uring.cq_head;
+                unsigned tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+
+                for (; head != tail; head++) {
+                        struct io_uring_cqe *cqe = uring.cqes + (head & *uring.cq_mask);
+
+                        if (cqe->user_data == URING_WAKE) {
+                                handle_wake();
+                                uring_poll_wake();
+                                continue;
+                        }
+
+                        if (cqe->user_data & URING_OUT) {
+                                uring_complete_write((struct subprocess *)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_OUT),
+                                                     cqe->res);
+                                continue;
+                        }
+
+                        notify |= uring_complete_read((struct subprocess *)(uintptr_t)cqe->user_data,
+                                                      cqe->res);
+                }
+
+                __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+
+                /* One wakeup for the whole batch. */
+                if (notify) notify_main();
+
+                free_closed();
+        }
+
+        return NULL;
+}
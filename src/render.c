@@ -1,44 +1,145 @@
-#define _XOPEN_SOURCE 600
-#include <wchar.h>
-
 #include "render.h"
 
 #include <stdbool.h>
+#include <stddef.h>                 /* offsetof */
 #include <stdio.h>
 
 #include "gl.h"                 /* bind_attribute_to_program, bind_unifo... */
 #include "term.h"
 #include "window.h"
+#include "paste.h"
+#include "wcwidth.h"
+
+/*
+ * The sprite table has two texels for each sprite, this many a row.
+ * VOLATILE: The vertex shader has the table's size written into it.
+ */
+#define SPRITE_TABLE_WIDTH 1024
+#define SPRITE_TABLE_HEIGHT ((NUM_CELL + SPRITE_TABLE_WIDTH - 1) / SPRITE_TABLE_WIDTH)
+
+static GLuint link_program(const char *vs, const char *fs)
+{
+        GLuint gvs = create_shader(vs, GL_VERTEX_SHADER);
+        GLuint gfs = create_shader(fs, GL_FRAGMENT_SHADER);
+
+        if (!gvs || !gfs) return 0;
+
+        GLuint program = glCreateProgram();
+        glAttachShader(program, gvs);
+        glAttachShader(program, gfs);
+        glLinkProgram(program);
+
+        GLint link_ok = GL_FALSE;
+        glGetProgramiv(program, GL_LINK_STATUS, &link_ok);
+
+        if (!link_ok) {
+                fprintf(stderr, "glLinkProgram:");
+                print_gl_error_log(program);
+                return 0;
+        }
+
+        return program;
+}
+
+static void pack_color(uint8_t *out, struct color c)
+{
+        out[0] = c.r * 255 + 0.5;
+        out[1] = c.g * 255 + 0.5;
+        out[2] = c.b * 255 + 0.5;
+        out[3] = 255;
+}
 
 int render_init(struct font_renderer *r, struct font_manager *m, struct color *color256)
 {
-        const char vs[] = "#version 120\n\
-attribute vec2 coord;\n\
-attribute vec3 decoration_color;\n\
-attribute vec3 tex_color;\n\
-varying vec3 dec_color;\n\
-varying vec3 tcolor;\n\
+        /*
+         * Each cell is drawn as an instance of some quads, and `corner`
+         * is which corner of which quad this is. The cell is at column
+         * `cell.x` of row `cell.y` of the grid's ring, which is `head`
+         * rows around from the top of the screen. Its sprite `cell.z`
+         * has the box its glyph goes in and the glyph's texture
+         * coordinates in the sprite table, and `cell.w` holds its
+         * flags.
+         *
+         * The first pass draws the backgrounds as one quad over the
+         * whole grid, which the first cell draws, and then each cell's
+         * underline. The last cell draws the cursor and such over
+         * them.
+         * The second draws the glyphs from whichever atlas they're
+         * in. Anything which isn't there gets an empty quad.
+         */
+        const char vs[] = "#version 130\n\
+in vec3 corner;\n\
+in vec4 cell;\n\
+in vec4 fg;\n\
+uniform sampler2D sprites;\n\
+uniform int pass;\n\
+uniform vec2 scale;\n\
+uniform vec2 size;\n\
+uniform float pitch;\n\
+uniform float head;\n\
+uniform float rows;\n\
+uniform vec2 last;\n\
+uniform vec4 overlay[2];\n\
+uniform vec3 overlay_color[2];\n\
+out vec3 tcoord;\n\
+out vec3 color;\n\
+flat out int kind;\n\
 void main(void) {\n\
-        gl_Position = vec4(coord.xy, 0, 1);\n\
-        dec_color = decoration_color;\n\
-        tcolor = tex_color;\n\
+        vec2 origin = vec2(cell.x * size.x, mod(cell.y - head + rows, rows) * pitch);\n\
+        float flags = cell.w;\n\
+        vec4 box = vec4(0);\n\
+        tcoord = vec3(0);\n\
+        color = fg.rgb;\n\
+        kind = 0;\n\
+        if (pass == 0) {\n\
+                if (corner.z == 0) {\n\
+                        if (cell.xy == vec2(0)) {\n\
+                                origin = vec2(0);\n\
+                                box = vec4(0, 0, (last.x + 1) * size.x, (last.y + 1) * pitch);\n\
+                                tcoord = vec3(corner.xy * box.zw, 0);\n\
+                                kind = 3;\n\
+                        }\n\
+                } else if (corner.z == 1) {\n\
+                        if (mod(floor(flags / 16), 2) == 1) box = vec4(0, size.y + 2, size.x, 1);\n\
+                        color = vec3(1);\n\
+                } else if (cell.xy == last) {\n\
+                        int i = int(corner.z) - 2;\n\
+                        origin = vec2(0);\n\
+                        box = overlay[i];\n\
+                        color = overlay_color[i];\n\
+                }\n\
+        } else if (mod(floor(flags / 32), 2) == 1) {\n\
+                vec2 at = vec2(mod(cell.z, 1024) * 2 + 0.5, floor(cell.z / 1024) + 0.5) / vec2(2048, 32);\n\
+                vec4 tex = textureLod(sprites, at + vec2(1.0 / 2048, 0), 0);\n\
+                box = textureLod(sprites, at, 0);\n\
+                tcoord = vec3(mix(tex.xy, tex.zw, corner.xy), mod(flags, 16));\n\
+                kind = 1 + int(mod(floor(flags / 64), 2));\n\
+        }\n\
+        vec2 p = origin + box.xy + corner.xy * box.zw;\n\
+        gl_Position = vec4(p.x * scale.x - 1, 1 - p.y * scale.y, 0, 1);\n\
 }";
 
-        const char fs[] = "#version 120\n\
-varying vec3 dec_color;\n\
-varying vec3 tcolor;\n\
-uniform sampler2D tex;\n\
-uniform int is_solid;\n\
-uniform int is_color;\n\
+        const char fs[] = "#version 130\n\
+in vec3 tcoord;\n\
+in vec3 color;\n\
+flat in int kind;\n\
+uniform sampler2DArray alpha;\n\
+uniform sampler2DArray colors;\n\
+uniform sampler2D backgrounds;\n\
+uniform vec2 size;\n\
+uniform float pitch;\n\
+uniform float head;\n\
+uniform float rows;\n\
 void main(void) {\n\
-        if (is_solid == 1) {\n\
-                gl_FragColor = vec4(dec_color, 1);\n\
-        } else if (is_color == 1) {\n\
-                //gl_FragColor = vec4(1, 1, 0.5, 1);\n\
-                gl_FragColor = texture2D(tex, dec_color.xy);\n\
-                //gl_FragColor = vec4(dec_color.xy / 0.0625, 1, 1);\n\
+        if (kind == 3) {\n\
+                vec2 at = floor(tcoord.xy / vec2(size.x, pitch));\n\
+                gl_FragColor = texelFetch(backgrounds, ivec2(at.x, mod(at.y + head, rows)), 0);\n\
+        } else if (kind == 0) {\n\
+                gl_FragColor = vec4(color, 1);\n\
+        } else if (kind == 2) {\n\
+                gl_FragColor = texture(colors, tcoord);\n\
         } else {\n\
-                gl_FragColor = vec4(tcolor, texture2D(tex, dec_color.xy).a);\n\
+                gl_FragColor = vec4(color, texture(alpha, tcoord).r);\n\
         }\n\
 }";
 
@@ -60,70 +161,41 @@ void main(void) {\n\
     gl_FragColor = texture2D(tex, tcoord.xy);\n\
 }";
 
-        /* Compile each shader. */
-        GLuint gvs = create_shader(vs, GL_VERTEX_SHADER);
-        GLuint gfs = create_shader(fs, GL_FRAGMENT_SHADER);
-
-        if (!gvs || !gfs) return 1;
+        r->program = link_program(vs, fs);
+        r->ui_program = link_program(vs2, fs2);
 
-        /* Create the program and link the shaders. */
-        r->program = glCreateProgram();
-        glAttachShader(r->program, gvs);
-        glAttachShader(r->program, gfs);
-        glLinkProgram(r->program);
-
-        /* Now check that everything compiled and linked okay. */
-        GLint link_ok = GL_FALSE;
-        glGetProgramiv(r->program, GL_LINK_STATUS, &link_ok);
-
-        if (!link_ok) {
-                fprintf(stderr, "glLinkProgram:");
-                print_gl_error_log(r->program);
-                return 1;
-        }
-
-        GLuint gvs2 = create_shader(vs2, GL_VERTEX_SHADER);
-        GLuint gfs2 = create_shader(fs2, GL_FRAGMENT_SHADER);
-
-        if (!gvs2 || !gfs2) return 1;
-
-        r->ui_program = glCreateProgram();
-        glAttachShader(r->ui_program, gvs2);
-        glAttachShader(r->ui_program, gfs2);
-        glLinkProgram(r->ui_program);
-
-        glGetProgramiv(r->ui_program, GL_LINK_STATUS, &link_ok);
-
-        if (!link_ok) {
-                fprintf(stderr, "glLinkProgram:");
-                print_gl_error_log(r->ui_program);
-                return 1;
-        }
+        if (!r->program || !r->ui_program) return 1;
 
         r->ui_attribute_coord = bind_attribute_to_program(r->ui_program, "coord");
 
-        r->attribute_coord = bind_attribute_to_program(r->program, "coord");
-        r->attribute_decoration_color = bind_attribute_to_program(r->program, "decoration_color");
-        r->attribute_color = bind_attribute_to_program(r->program, "tex_color");
+        r->attribute_corner = bind_attribute_to_program(r->program, "corner");
+        r->attribute_cell = bind_attribute_to_program(r->program, "cell");
+        r->attribute_fg = bind_attribute_to_program(r->program, "fg");
 
         r->uniform_ui_tex = bind_uniform_to_program(r->ui_program, "tex");
         r->uniform_ui_scale = bind_uniform_to_program(r->ui_program, "scale");
         r->uniform_ui_offset = bind_uniform_to_program(r->ui_program, "offset");
 
-        r->uniform_tex = bind_uniform_to_program(r->program, "tex");
-        r->uniform_is_solid = bind_uniform_to_program(r->program, "is_solid");
-        r->uniform_is_color = bind_uniform_to_program(r->program, "is_color");
+        r->uniform_alpha = bind_uniform_to_program(r->program, "alpha");
+        r->uniform_colors = bind_uniform_to_program(r->program, "colors");
+        r->uniform_sprites = bind_uniform_to_program(r->program, "sprites");
+        r->uniform_backgrounds = bind_uniform_to_program(r->program, "backgrounds");
+        r->uniform_pass = bind_uniform_to_program(r->program, "pass");
+        r->uniform_scale = bind_uniform_to_program(r->program, "scale");
+        r->uniform_size = bind_uniform_to_program(r->program, "size");
+        r->uniform_pitch = bind_uniform_to_program(r->program, "pitch");
+        r->uniform_head = bind_uniform_to_program(r->program, "head");
+        r->uniform_rows = bind_uniform_to_program(r->program, "rows");
+        r->uniform_last = bind_uniform_to_program(r->program, "last");
+        r->uniform_overlay = bind_uniform_to_program(r->program, "overlay");
+        r->uniform_overlay_color = bind_uniform_to_program(r->program, "overlay_color");
 
         /* Enabling blending allows us to use alpha textures. */
         glEnable(GL_BLEND);
         glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
-        /* Generate the underline VBO. */
-        glGenBuffers(1, &r->vbo_decoration);
-        r->decoration = calloc(NUM_CELL * 2, 6 * 2 * sizeof(GLfloat));
-        glGenBuffers(1, &r->vbo_decoration_color);
-        r->decoration_color = calloc(NUM_CELL * 2, 6 * 3 * sizeof(GLfloat));
         r->num_fonts = m->num_fonts;
+        r->persistent = GLEW_ARB_buffer_storage;
 
         struct {
                 GLfloat x, y, s, t;
@@ -153,148 +225,136 @@ void main(void) {\n\
                               0);
 
         /*
-         * So the renderer needs to keep track of some per-font data, including
-         * each of these VBOs and a spritemap texture.
+         * The corners of each of a cell's quads: its glyph or the
+         * backgrounds, its underline and the two overlay rectangles.
          */
-        for (int i = 0; i < r->num_fonts; i++) {
+        GLfloat corner[4 * 6][3];
+
+        for (int i = 0; i < 4; i++) {
+                GLfloat quad[6][2] = {
+                        { 0, 0 }, { 1, 0 }, { 0, 1 },
+                        { 1, 1 }, { 1, 0 }, { 0, 1 },
+                };
+
+                for (int j = 0; j < 6; j++) {
+                        corner[6 * i + j][0] = quad[j][0];
+                        corner[6 * i + j][1] = quad[j][1];
+                        corner[6 * i + j][2] = i;
+                }
+        }
+
+        glGenBuffers(1, &r->vbo_corner);
+        glBindBuffer(GL_ARRAY_BUFFER, r->vbo_corner);
+        glBufferData(GL_ARRAY_BUFFER, sizeof corner, corner, GL_STATIC_DRAW);
+
+        /*
+         * Each sprite has its box in the first texel and its texture
+         * coordinates in the second, and they're only ever read at
+         * their centers.
+         */
+        glGenTextures(1, &r->sprite_table);
+        glBindTexture(GL_TEXTURE_2D, r->sprite_table);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, 2 * SPRITE_TABLE_WIDTH,
+                     SPRITE_TABLE_HEIGHT, 0, GL_RGBA, GL_FLOAT, NULL);
+
+        int layers[2] = { 0, 0 };
+
+        for (int i = 0; i < m->num_fonts; i++) {
                 struct font_data *f = r->fonts + i;
 
                 *f = (struct font_data){
-                        .vertices = calloc(NUM_CELL * 2, 6 * 2 * sizeof(GLfloat)),
-                        .textures = calloc(NUM_CELL * 2, 6 * 3 * sizeof(GLfloat)),
-                        .colors = calloc(NUM_CELL * 2, 6 * 3 * sizeof(GLfloat)),
+                        .layer = layers[!!m->fonts[i].is_color_font]++,
                         .is_color_font = m->fonts[i].is_color_font,
                         .font = m->fonts + i,
                 };
-
-                glGenBuffers(1, &f->vbo_vertices);
-                glGenBuffers(1, &f->vbo_textures);
-                glGenBuffers(1, &f->vbo_colors);
-
-                glGenTextures(1, &f->sprite_texture);
         }
 
+        /* An atlas with no fonts in it still has to be something. */
+        glGenTextures(1, &r->alpha_atlas);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, r->alpha_atlas);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_R8,
+                     layers[0] ? 2048 : 1, layers[0] ? 2048 : 1, layers[0] ? layers[0] : 1,
+                     0, GL_RED, GL_UNSIGNED_BYTE, NULL);
+
+        glGenTextures(1, &r->color_atlas);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, r->color_atlas);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8,
+                     layers[1] ? 2048 : 1, layers[1] ? 2048 : 1, layers[1] ? layers[1] : 1,
+                     0, GL_BGRA, GL_UNSIGNED_BYTE, NULL);
+        glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+
         r->m = m;
         r->color256 = color256;
+
+        for (int i = 0; i < 256; i++)
+                pack_color(r->rgba256[i], color256[i]);
         r->width = 800;
         r->height = 800;
 
         return 0;
 }
 
+/*
+ * Adds a rectangle to be drawn over the screen. The edges are pixels
+ * from the top left of the screen.
+ */
 void render_rectangle(struct font_renderer *r, float n, float s, float w,
         float e, struct color color)
 {
-        struct {
-                GLfloat x, y;
-        } box[6] = {
-                { w, n },
-                { e, n },
-                { w, s },
-                { e, s },
-                { e, n },
-                { w, s },
+        r->decoration[r->num_decoration++] = (struct rect){
+                .x = w,
+                .y = n,
+                .w = e - w,
+                .h = s - n,
+                .color = { color.r, color.g, color.b },
         };
-
-        struct color col[] = { color, color, color, color, color, color };
-
-        memcpy(r->decoration + r->num_decoration * sizeof box,
-               box, sizeof box);
-        memcpy(r->decoration_color + r->num_decoration * sizeof col,
-               col, sizeof col);
-        r->num_decoration++;
 }
 
-struct color get_color_from_index(struct font_renderer *r, int i)
+struct color get_color_from_index(struct font_renderer *r, struct palette *p, int i)
 {
-        if (i >= 0 && i < 256) return r->color256[i];
-        i -= 256;
-        int R = (i >> 16) & 0xFF;
-        int G = (i >> 8) & 0xFF;
-        int B = (i >> 0) & 0xFF;
+        /* TODO: Make the default colors configurable. */
+        if (i < 0) return (struct color){ 1, 1, 1 };
+        if (i < 256) return r->color256[i];
+        uint32_t rgb = p->rgb[i - 256];
+        int R = (rgb >> 16) & 0xFF;
+        int G = (rgb >> 8) & 0xFF;
+        int B = (rgb >> 0) & 0xFF;
         return (struct color){ R / 255.0, G / 255.0, B / 255.0 };
 }
 
-/*
- * Renders a `struct cell` into the current termbuffer.
- */
-int render_cell(struct font_renderer *r, uint32_t c, struct cell_attr attr,
-                int x0, int y0, int cw, int ch, int width, int height,
-                int font_size)
+static void cell_color(struct font_renderer *r, struct palette *p, int i, uint8_t *out)
 {
-        if (attr.mode & CELL_DUMMY) return 0;
-
-        struct sprite *sprite = get_sprite(r->m, c, attr.mode, font_size);
-
-        if (!sprite) {
-                fprintf(stderr, "No cell found for U+%x\n", c);
-                return 1;
-        }
-
-        FT_Glyph_Metrics metrics = sprite->metrics;
-
-        float sx = 2.0 / width;
-        float sy = 2.0 / height;
-
-        /* Calculate the vertex and texture coordinates. */
-        float x = -1 + (cw * x0) * sx;
-        float y = 1 - (ch * (1 + y0)) * sy - LINE_SPACING * y0 * sy;
-        float x2 = x + metrics.horiBearingX * 1.0/64.0 * sx;
-        float y2 = -y - sprite->bitmap_top * sy;
-        float w = metrics.width * 1.0/64.0 * sx;
-        float h = metrics.height * 1.0/64.0 * sy;
-
-        /*
-         * HACK: The `+ 5 * sy` term allows five pixels of leeway when we're
-         * resizing big characters. Theoretically with a proper monospace font
-         * there shouldn't be any characters taller than the advance width, but
-         * that doesn't seem to be the case. Deja Vu Sans Mono's j character is
-         * taller than the vertical advance width, for example, and the line
-         * drawing characters also tend to exceed the vertical advance width in
-         * many fonts. This is mainly to deal with fonts like Noto Color Emoji
-         * which have really giant characters which refuse to render at other
-         * sizes and have to be forcibly scaled down.
-         */
-        if (h > ch * sy + 5 * sy) {
-                float tmp = wcwidth(c) * (float)cw * sx + 0.1 * LINE_SPACING * sx;
-                float ratio = tmp / w;
-                w = tmp;
-                h *= ratio;
-                y2 = -y - ch * sy;
-                if (ch * sy - h > 0)
-                        y2 += ch * sy - h;
+        if (i >= 0 && i < 256) {
+                memcpy(out, r->rgba256[i], 4);
+                return;
         }
 
-        struct {
-                GLfloat x, y;
-        } box[6] = {
-                { x2    , -y2     },
-                { x2 + w, -y2     },
-                { x2    , -y2 - h },
-
-                { x2 + w, -y2 - h },
-                { x2 + w, -y2     },
-                { x2    , -y2 - h },
-        };
-
-        struct {
-                GLfloat s, t, v;
-        } tex[6] = {
-                { sprite->tex_coords[0], sprite->tex_coords[1], 0 },
-                { sprite->tex_coords[2], sprite->tex_coords[1], 0 },
-                { sprite->tex_coords[0], sprite->tex_coords[3], 0 },
-
-                { sprite->tex_coords[2], sprite->tex_coords[3], 0 },
-                { sprite->tex_coords[2], sprite->tex_coords[1], 0 },
-                { sprite->tex_coords[0], sprite->tex_coords[3], 0 },
-        };
+        pack_color(out, get_color_from_index(r, p, i));
+}
 
+/*
+ * Fills in the instance and background for a `struct cell` with the
+ * glyph `sprite`.
+ */
+static void render_cell(struct font_renderer *r, struct palette *p, struct cell cell,
+                        struct sprite *sprite, struct instance *in, uint8_t *bg)
+{
         /* TODO: Make default fg and other colors configurable. */
 
-        int bfg = attr.fg;
-        int bbg = attr.bg;
+        int bfg = cell.fg;
+        int bbg = cell.bg;
 
-        if (attr.mode & CELL_INVERSE) {
+        if (cell.mode & CELL_INVERSE) {
                 if (bbg < 0) bbg = 16;
                 if (bfg < 0) bfg = 255;
 
@@ -303,48 +363,102 @@ int render_cell(struct font_renderer *r, uint32_t c, struct cell_attr attr,
                 bbg = tmp;
         }
 
-        struct color fg = get_color_from_index(r, bfg);
-        struct color bg = get_color_from_index(r, bbg);
+        struct font_data *font = r->fonts + sprite->font;
+
+        in->sprite = sprite - r->m->cell;
+        in->flags = font->layer | INSTANCE_GLYPH;
 
-        struct color col[] = { fg, fg, fg, fg, fg, fg };
+        if (font->is_color_font) in->flags |= INSTANCE_COLOR;
 
-        struct font_data *font = r->fonts + sprite->font;
+        if (cell.mode & CELL_UNDERLINE) in->flags |= INSTANCE_UNDERLINE;
 
-        memcpy(font->vertices + font->num_cells_in_vbo * sizeof box, box, sizeof box);
-        memcpy(font->textures + font->num_cells_in_vbo * sizeof tex, tex, sizeof tex);
-        memcpy(font->colors + font->num_cells_in_vbo * sizeof col, col, sizeof col);
-        font->num_cells_in_vbo++;
-
-        if (bbg != -1)
-                render_rectangle(r,
-                                 y + ch * sy,
-                                 y - LINE_SPACING * sy,
-                                 x + cw * sx,
-                                 x,
-                                 bg);
-
-        if (attr.mode & CELL_UNDERLINE)
-                render_rectangle(r,
-                                 y - 3 * sy + 1 * sy,
-                                 y - 3 * sy,
-                                 x,
-                                 x + cw * sx,
-                                 (struct color){1, 1, 1});
+        cell_color(r, p, bfg, in->fg);
 
-        return 0;
+        if (bbg != -1) cell_color(r, p, bbg, bg);
 }
 
-void render_cursor(struct font_renderer *r, struct cursor *cursor, int cw, int ch, int width, int height, bool wide)
+/*
+ * Puts the sprites which have been made since the last frame in the
+ * sprite table: the box each one's glyph goes in, relative to the top
+ * left of its cell, and its texture coordinates.
+ */
+static void render_sprites(struct font_renderer *r)
 {
-        int x = cursor->x, y = cursor->y;
+        struct font_manager *m = r->m;
+
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, r->sprite_table);
+
+        while (r->num_sprites < m->num_cell) {
+                int i = r->num_sprites;
+                int n = m->num_cell - i;
+
+                if (n > SPRITE_TABLE_WIDTH - i % SPRITE_TABLE_WIDTH)
+                        n = SPRITE_TABLE_WIDTH - i % SPRITE_TABLE_WIDTH;
+
+                GLfloat entry[n][8];
+
+                for (int k = 0; k < n; k++) {
+                        struct sprite *sprite = m->cell + i + k;
+                        FT_Glyph_Metrics metrics = sprite->metrics;
+                        int cw, ch;
+
+                        font_get_dimensions(m, &cw, &ch, sprite->font_size);
+
+                        float x = metrics.horiBearingX * 1.0/64.0;
+                        float y = ch - sprite->bitmap_top;
+                        float w = metrics.width * 1.0/64.0;
+                        float h = metrics.height * 1.0/64.0;
+
+                        /*
+                         * HACK: The `+ 5` term allows five pixels of leeway when we're
+                         * resizing big characters. Theoretically with a proper monospace font
+                         * there shouldn't be any characters taller than the advance width, but
+                         * that doesn't seem to be the case. Deja Vu Sans Mono's j character is
+                         * taller than the vertical advance width, for example, and the line
+                         * drawing characters also tend to exceed the vertical advance width in
+                         * many fonts. This is mainly to deal with fonts like Noto Color Emoji
+                         * which have really giant characters which refuse to render at other
+                         * sizes and have to be forcibly scaled down.
+                         */
+                        if (h > ch + 5) {
+                                float tmp = kty_wcwidth(sprite->c) * (float)cw + 0.1 * LINE_SPACING;
+                                float ratio = tmp / w;
+                                w = tmp;
+                                h *= ratio;
+                                y = 0;
+                                if (ch - h > 0)
+                                        y += ch - h;
+                        }
+
+                        GLfloat e[8] = {
+                                x, y, w, h,
+                                sprite->tex_coords[0], sprite->tex_coords[1],
+                                sprite->tex_coords[2], sprite->tex_coords[3],
+                        };
+
+                        memcpy(entry[k], e, sizeof e);
+                }
 
-        float sx = 2.0 / (float)width;
-        float sy = 2.0 / (float)height;
+                glTexSubImage2D(GL_TEXTURE_2D, 0,
+                                2 * (i % SPRITE_TABLE_WIDTH),
+                                i / SPRITE_TABLE_WIDTH,
+                                2 * n, 1, GL_RGBA, GL_FLOAT, entry);
+
+                r->num_sprites += n;
+        }
+
+        glActiveTexture(GL_TEXTURE0);
+}
+
+void render_cursor(struct font_renderer *r, struct cursor *cursor, int cw, int ch, bool wide)
+{
+        int x = cursor->x, y = cursor->y;
 
-        float w = -1 + (cw * x) * sx;
-        float n = 1 - (ch * y) * sy - LINE_SPACING * y * sy;
-        float s = n - ch * sy - LINE_SPACING * sy;
-        float e = w + cw * sx;
+        float w = cw * x;
+        float n = (ch + LINE_SPACING) * y;
+        float s = n + ch + LINE_SPACING;
+        float e = w + cw;
 
         /* TODO: Default cursor color customization. */
         struct color c = (struct color){ 0, 0.5, 0.5 };
@@ -355,16 +469,16 @@ void render_cursor(struct font_renderer *r, struct cursor *cursor, int cw, int c
                 case CURSOR_STYLE_DEFAULT:
                 case CURSOR_STYLE_STEADY_BLOCK:
                         /* Thicken the cursor. */
-                        if (wide) e += cw * sx;
+                        if (wide) e += cw;
                         break;
                 case CURSOR_STYLE_BLINKING_UNDERLINE:
                 case CURSOR_STYLE_STEADY_UNDERLINE:
-                        n = s + 3 * sy;
+                        n = s - 3;
                         c = (struct color){ 1, 1, 1 };
                         break;
                 case CURSOR_STYLE_BLINKING_BAR:
                 case CURSOR_STYLE_STEADY_BAR:
-                        e = w + 2 * sx;
+                        e = w + 2;
                         c = (struct color){ 1, 1, 1 };
                         break;
         }
@@ -401,170 +515,398 @@ void render_quad(struct font_renderer *r, int x0, int y0, int x1, int y1, GLuint
 
         glActiveTexture(GL_TEXTURE0);
         glBindTexture(GL_TEXTURE_2D, tex);
-        glGenerateMipmap(GL_TEXTURE_2D);
 
         glDrawArrays(GL_TRIANGLES, 0, 6);
 }
 
-void render_wterm(struct font_renderer *r, struct wterm *wt)
+/*
+ * Builds slice `row` of the wterm's row buffer from `line`.
+ */
+static void render_row(struct font_renderer *r, struct wterm *wt,
+                       const struct cell *line, int row)
+{
+        struct rowbuffer *b = &wt->rows;
+        struct palette *p = &wt->term->truecolor;
+        struct instance *v = b->v + row * b->col;
+        uint8_t (*bg)[4] = b->bg + row * b->col;
+
+        memset(bg, 0, b->col * sizeof *bg);
+        b->built[row] = b->builds;
+
+        for (int j = 0; j < b->col; j++) {
+                struct instance *in = v + j;
+
+                *in = (struct instance){ .x = j, .y = row };
+
+                if (!line[j].c || line[j].mode & CELL_DUMMY) continue;
+
+                struct sprite *sprite = get_sprite(r->m, line[j].c, line[j].mode, wt->font_size);
+
+                if (!sprite) {
+                        fprintf(stderr, "No cell found for U+%x\n", line[j].c);
+                        continue;
+                }
+
+                render_cell(r, p, line[j], sprite, in, bg[j]);
+        }
+}
+
+/*
+ * Brings the wterm's row buffer up to date with its grid, only
+ * building the rows which have changed since the last frame. Returns
+ * whether any were built.
+ */
+static bool render_rows(struct font_renderer *r, struct wterm *wt, int scroll)
 {
+        struct rowbuffer *b = &wt->rows;
         struct term *t = wt->term;
         struct grid *g = t->g;
+        unsigned long since = b->frame;
+        bool all = b->g != g || b->scroll != scroll
+                || b->cw != wt->cw || b->ch != wt->ch
+                || b->font_size != wt->font_size;
+
+        if (!b->bg_texture) {
+                glGenTextures(1, &b->bg_texture);
+                glBindTexture(GL_TEXTURE_2D, b->bg_texture);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        }
 
-        /* TODO: Move this somewhere sensible. */
-        glBindTexture(GL_TEXTURE_2D, wt->tex_color_buffer);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, wt->width,
-                     wt->height, 0, GL_RGB, GL_UNSIGNED_BYTE,
-                     NULL);
+        if (b->col != g->col || b->row != g->row) {
+                size_t n = g->row * g->col;
 
-        /* TODO: Clean up the framebuffer. */
-        glBindFramebuffer(GL_FRAMEBUFFER, wt->framebuffer);
-        glViewport(0, 0, wt->width, wt->height);
-        glUseProgram(r->program);
+                b->col = g->col;
+                b->row = g->row;
+                b->v = realloc(b->v, n * sizeof *b->v);
+                b->bg = realloc(b->bg, n * sizeof *b->bg);
+                b->built = realloc(b->built, g->row * sizeof *b->built);
 
-        glClearColor(0, 0, 0, 1);
-        glClear(GL_COLOR_BUFFER_BIT);
+                /* A buffer's storage can't change size, so it's made again. */
+                glDeleteBuffers(1, &b->vbo);
+                glGenBuffers(1, &b->vbo);
+                glBindBuffer(GL_ARRAY_BUFFER, b->vbo);
 
-        /* Reset the VBO render state. */
-        for (int i = 0; i < r->num_fonts; i++)
-                r->fonts[i].num_cells_in_vbo = 0;
+                for (int i = 0; i < RENDER_BUFFERS; i++) {
+                        if (b->fence[i]) glDeleteSync(b->fence[i]);
+                        b->fence[i] = 0;
+                        b->written[i] = 0;
+                }
 
-        r->num_decoration = 0;
+                if (r->persistent) {
+                        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
 
-        for (int i = 0; i < g->row; i++)
-                for (int j = 0; j < g->col; j++)
-                        if (g->line[i][j])
-                                render_cell(r, g->line[i][j], g->attr[i][j], j, i, wt->cw, wt->ch, wt->width, wt->height, wt->font_size);
+                        glBufferStorage(GL_ARRAY_BUFFER, RENDER_BUFFERS * n * sizeof *b->v, NULL, flags);
+                        b->map = glMapBufferRange(GL_ARRAY_BUFFER, 0, RENDER_BUFFERS * n * sizeof *b->v, flags);
+                } else {
+                        glBufferData(GL_ARRAY_BUFFER, n * sizeof *b->v, NULL, GL_DYNAMIC_DRAW);
+                }
 
-        /* Add the cursor to the decoration VBO. */
-        if (t->mode & MODE_CURSOR_VISIBLE)
-                render_cursor(r, t->c, wt->cw, wt->ch, wt->width, wt->height, g->attr[t->c->y][t->c->x].mode & CELL_WIDE);
+                glBindTexture(GL_TEXTURE_2D, b->bg_texture);
+                glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, g->col, g->row, 0,
+                             GL_RGBA, GL_UNSIGNED_BYTE, NULL);
 
-        /* Render the quads. */
-        glUniform1i(r->uniform_is_solid, 1);
+                all = true;
+        }
 
-        glBindBuffer(GL_ARRAY_BUFFER, r->vbo_decoration);
-        glEnableVertexAttribArray(r->attribute_coord);
+        b->g = g;
+        b->scroll = scroll;
+        b->cw = wt->cw;
+        b->ch = wt->ch;
+        b->font_size = wt->font_size;
+        b->frame = term_frame(t);
+        b->builds++;
 
-        glBufferData(GL_ARRAY_BUFFER,
-                     r->num_decoration * 6 * 2 * sizeof(GLfloat),
-                     r->decoration,
-                     GL_DYNAMIC_DRAW);
+        int x0, x1;
 
-        glVertexAttribPointer(r->attribute_coord,
-                              2,
-                              GL_FLOAT,
-                              GL_FALSE,
-                              2 * sizeof(GLfloat),
-                              0);
+        /* The rows of the view don't stay put, so any change moves them all. */
+        if (scroll && b->scrolled != g->scrolled) all = true;
 
-        glBindBuffer(GL_ARRAY_BUFFER, r->vbo_decoration_color);
-        glEnableVertexAttribArray(r->attribute_decoration_color);
+        for (int i = 0; scroll && !all && i < g->row; i++)
+                if (term_damage(t, i, since, &x0, &x1)) all = true;
 
-        glBufferData(GL_ARRAY_BUFFER,
-                     r->num_decoration * 6 * 3 * sizeof(GLfloat),
-                     r->decoration_color,
-                     GL_DYNAMIC_DRAW);
+        b->scrolled = g->scrolled;
 
-        glVertexAttribPointer(r->attribute_decoration_color,
-                              3,
-                              GL_FLOAT,
+        int lo = g->row, hi = -1;
+
+        for (int i = 0; i < g->row; i++) {
+                struct cell buf[g->col];
+                const struct cell *line = NULL;
+
+                if (scroll && !all) break;
+
+                if (scroll && i < scroll) {
+                        scrollback_line(&t->scrollback, scroll - 1 - i, buf, g->col, NULL);
+                        line = buf;
+                } else if (scroll) {
+                        line = g->line[ROW(g, i - scroll)];
+                } else if (all || term_damage(t, i, since, &x0, &x1)) {
+                        line = g->line[i];
+                }
+
+                if (!line) continue;
+
+                render_row(r, wt, line, i);
+
+                if (i < lo) lo = i;
+                hi = i;
+        }
+
+        /* The backgrounds of every row which was built go up at once. */
+        if (lo <= hi) {
+                glBindTexture(GL_TEXTURE_2D, b->bg_texture);
+                glTexSubImage2D(GL_TEXTURE_2D, 0, 0, lo, b->col, hi - lo + 1,
+                                GL_RGBA, GL_UNSIGNED_BYTE, b->bg + lo * b->col);
+        }
+
+        return lo <= hi;
+}
+
+/*
+ * Copies the slices which have been built since the copy of the row
+ * buffer about to be drawn from was last drawn from into it, a run of
+ * slices at a time.
+ */
+static void render_upload(struct font_renderer *r, struct rowbuffer *b)
+{
+        size_t n = b->row * b->col;
+        int k = 0, stale = 0;
+
+        glBindBuffer(GL_ARRAY_BUFFER, b->vbo);
+
+        if (r->persistent) {
+                k = b->copy = (b->copy + 1) % RENDER_BUFFERS;
+
+                if (b->fence[k]) {
+                        glClientWaitSync(b->fence[k], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+                        glDeleteSync(b->fence[k]);
+                        b->fence[k] = 0;
+                }
+        }
+
+        for (int y = 0; y < b->row; y++)
+                stale += b->built[y] > b->written[k];
+
+        /* Let the driver find somewhere else to put it all. */
+        if (!r->persistent && stale == b->row) {
+                glBufferData(GL_ARRAY_BUFFER, n * sizeof *b->v, NULL, GL_DYNAMIC_DRAW);
+                glBufferSubData(GL_ARRAY_BUFFER, 0, n * sizeof *b->v, b->v);
+                b->written[k] = b->builds;
+                return;
+        }
+
+        for (int y = 0; y < b->row;) {
+                if (b->built[y] <= b->written[k]) {
+                        y++;
+                        continue;
+                }
+
+                int end = y;
+                while (end < b->row && b->built[end] > b->written[k]) end++;
+
+                size_t at = y * b->col, len = (end - y) * b->col * sizeof *b->v;
+
+                if (r->persistent)
+                        memcpy(b->map + k * n + at, b->v + at, len);
+                else
+                        glBufferSubData(GL_ARRAY_BUFFER, at * sizeof *b->v, len, b->v + at);
+
+                y = end;
+        }
+
+        b->written[k] = b->builds;
+}
+
+/*
+ * Points the cell program's attributes at the corners and the wterm's
+ * instances, or puts them back how everything else expects them.
+ */
+static void render_attributes(struct font_renderer *r, struct rowbuffer *b, bool enable)
+{
+        GLint instanced[] = { r->attribute_cell, r->attribute_fg };
+
+        if (!enable) {
+                glDisableVertexAttribArray(r->attribute_corner);
+
+                for (unsigned i = 0; i < sizeof instanced / sizeof *instanced; i++) {
+                        glVertexAttribDivisor(instanced[i], 0);
+                        glDisableVertexAttribArray(instanced[i]);
+                }
+
+                return;
+        }
+
+        glBindBuffer(GL_ARRAY_BUFFER, r->vbo_corner);
+        glEnableVertexAttribArray(r->attribute_corner);
+        glVertexAttribPointer(r->attribute_corner, 3, GL_FLOAT, GL_FALSE, 0, 0);
+
+        glBindBuffer(GL_ARRAY_BUFFER, b->vbo);
+
+        size_t base = r->persistent ? b->copy * b->row * b->col * sizeof(struct instance) : 0;
+
+        glEnableVertexAttribArray(r->attribute_cell);
+        glVertexAttribPointer(r->attribute_cell,
+                              4,
+                              GL_UNSIGNED_SHORT,
                               GL_FALSE,
-                              3 * sizeof(GLfloat),
-                              0);
+                              sizeof(struct instance),
+                              (void *)(base + offsetof(struct instance, x)));
 
-        glDrawArrays(GL_TRIANGLES, 0, r->num_decoration * 6);
+        glEnableVertexAttribArray(r->attribute_fg);
+        glVertexAttribPointer(r->attribute_fg,
+                              4,
+                              GL_UNSIGNED_BYTE,
+                              GL_TRUE,
+                              sizeof(struct instance),
+                              (void *)(base + offsetof(struct instance, fg)));
 
-        /*
-         * So each cell has been rendered into its font's spritesheet at this
-         * point.
-         */
 
-        for (int i = 0; i < r->num_fonts; i++) {
-                struct font_data *font = r->fonts + i;
+        for (unsigned i = 0; i < sizeof instanced / sizeof *instanced; i++)
+                glVertexAttribDivisor(instanced[i], 1);
+}
+
+/*
+ * Draws the wterm into its framebuffer, unless what's there is still
+ * what it would draw. Returns whether it drew anything.
+ */
+bool render_wterm(struct font_renderer *r, struct wterm *wt)
+{
+        struct term *t = wt->term;
+        struct grid *g = t->g;
+        struct rowbuffer *b = &wt->rows;
+
+        /* The alternate screen has no scrollback. */
+        int scroll = t->mode & MODE_ALTSCREEN ? 0 : t->scroll;
+        int head = scroll ? 0 : g->head;
+
+        bool changed = render_rows(r, wt, scroll);
+
+        render_sprites(r);
+
+        r->num_decoration = 0;
+
+        /* Add the cursor to the decoration VBO. */
+        if (t->mode & MODE_CURSOR_VISIBLE && !scroll)
+                render_cursor(r, t->c, wt->cw, wt->ch, g->line[ROW(g, t->c->y)][t->c->x].mode & CELL_WIDE);
+
+        /* Show how far along a long paste is along the bottom edge. */
+        if (wt->paste)
+                render_rectangle(r, wt->height - 4, wt->height, 0,
+                                 wt->width * paste_progress(wt->paste),
+                                 (struct color){ 0, 0.5, 0.5 });
+
+        if (!changed && b->head == head
+            && b->num_decoration == r->num_decoration
+            && !memcmp(b->decoration, r->decoration, r->num_decoration * sizeof *r->decoration)
+            && wt->tex_width == wt->width && wt->tex_height == wt->height)
+                return false;
+
+        b->head = head;
+        b->num_decoration = r->num_decoration;
+        memcpy(b->decoration, r->decoration, r->num_decoration * sizeof *r->decoration);
+
+        /* The texture only has to be made again when the size changes. */
+        if (wt->tex_width != wt->width || wt->tex_height != wt->height) {
+                glBindTexture(GL_TEXTURE_2D, wt->tex_color_buffer);
+                glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, wt->width,
+                             wt->height, 0, GL_RGB, GL_UNSIGNED_BYTE,
+                             NULL);
+                wt->tex_width = wt->width;
+                wt->tex_height = wt->height;
+        }
+
+        /* TODO: Clean up the framebuffer. */
+        glBindFramebuffer(GL_FRAMEBUFFER, wt->framebuffer);
+        glViewport(0, 0, wt->width, wt->height);
+        glClearColor(0, 0, 0, 1);
+        glClear(GL_COLOR_BUFFER_BIT);
+
+        glUseProgram(r->program);
+        glUniform2f(r->uniform_scale, 2.0 / wt->width, 2.0 / wt->height);
+        glUniform2f(r->uniform_size, wt->cw, wt->ch);
+        glUniform1f(r->uniform_pitch, wt->ch + LINE_SPACING);
+        glUniform1f(r->uniform_head, head);
+        glUniform1f(r->uniform_rows, g->row);
+
+        GLfloat overlay[2][4] = { { 0 } }, overlay_color[2][3];
+
+        for (unsigned i = 0; i < r->num_decoration; i++) {
+                struct rect *rect = r->decoration + i;
+                memcpy(overlay[i], &rect->x, sizeof overlay[i]);
+                memcpy(overlay_color[i], rect->color, sizeof overlay_color[i]);
+        }
+
+        glUniform2f(r->uniform_last, b->col - 1, b->row - 1);
+        glUniform4fv(r->uniform_overlay, 2, overlay[0]);
+        glUniform3fv(r->uniform_overlay_color, 2, overlay_color[0]);
 
-                glBindBuffer(GL_ARRAY_BUFFER, font->vbo_vertices);
-                glEnableVertexAttribArray(r->attribute_coord);
-
-                glBufferData(GL_ARRAY_BUFFER,
-                             font->num_cells_in_vbo * 6 * 2 * sizeof(GLfloat),
-                             font->vertices,
-                             GL_DYNAMIC_DRAW);
-
-                glVertexAttribPointer(r->attribute_coord,
-                                      2,
-                                      GL_FLOAT,
-                                      GL_FALSE,
-                                      2 * sizeof(GLfloat),
-                                      0);
-
-                glBindBuffer(GL_ARRAY_BUFFER, font->vbo_textures);
-                glEnableVertexAttribArray(r->attribute_decoration_color);
-
-                glBufferData(GL_ARRAY_BUFFER,
-                             font->num_cells_in_vbo * 6 * 3 * sizeof(GLfloat),
-                             font->textures,
-                             GL_DYNAMIC_DRAW);
-
-                glVertexAttribPointer(r->attribute_decoration_color,
-                                      3,
-                                      GL_FLOAT,
-                                      GL_FALSE,
-                                      3 * sizeof(GLfloat),
-                                      0);
-
-                glBindBuffer(GL_ARRAY_BUFFER, font->vbo_colors);
-                glEnableVertexAttribArray(r->attribute_color);
-
-                glBufferData(GL_ARRAY_BUFFER,
-                             font->num_cells_in_vbo * 6 * 3 * sizeof(GLfloat),
-                             font->colors,
-                             GL_DYNAMIC_DRAW);
-
-                glVertexAttribPointer(r->attribute_color,
-                                      3,
-                                      GL_FLOAT,
-                                      GL_FALSE,
-                                      3 * sizeof(GLfloat),
-                                      0);
-
-                glActiveTexture(GL_TEXTURE0 + i);
-                glBindTexture(GL_TEXTURE_2D, font->sprite_texture);
-                glUniform1i(r->uniform_tex, i);
-                glUniform1i(r->uniform_is_solid, 0);
+        /* Upload any spritemaps which have had sprites added to them. */
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
 
+        for (int i = 0; i < r->num_fonts; i++) {
+                struct font_data *font = r->fonts + i;
                 struct font *f = font->font;
 
                 /* TODO: Don't use a flag, use an update handler */
-                if (f->spritemap_dirty) {
-                        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+                if (!f->spritemap_dirty) continue;
 
-                        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-                        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+                glBindTexture(GL_TEXTURE_2D_ARRAY, f->is_color_font ? r->color_atlas : r->alpha_atlas);
+                glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, font->layer,
+                                2048, 2048, 1,
+                                f->is_color_font ? GL_BGRA : GL_RED,
+                                GL_UNSIGNED_BYTE,
+                                f->sprite_buffer);
 
-                        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
-                                        f->is_color_font ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
-                        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+                if (f->is_color_font) glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
 
-                        /* Upload the sprite map. */
+                f->spritemap_dirty = 0;
+        }
 
-                        glTexImage2D(GL_TEXTURE_2D,
-                                     0,
-                                     f->is_color_font ? GL_RGBA8 : GL_ALPHA,
-                                     2048,
-                                     2048,
-                                     0,
-                                     f->is_color_font ? GL_BGRA : GL_ALPHA,
-                                     GL_UNSIGNED_BYTE,
-                                     f->sprite_buffer);
+        glActiveTexture(GL_TEXTURE3);
+        glBindTexture(GL_TEXTURE_2D, b->bg_texture);
+        glActiveTexture(GL_TEXTURE2);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, r->color_atlas);
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, r->sprite_table);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, r->alpha_atlas);
 
-                        if (f->is_color_font) glGenerateMipmap(GL_TEXTURE_2D);
+        glUniform1i(r->uniform_alpha, 0);
+        glUniform1i(r->uniform_sprites, 1);
+        glUniform1i(r->uniform_colors, 2);
+        glUniform1i(r->uniform_backgrounds, 3);
 
-                        f->spritemap_dirty = 0;
-                }
+        render_upload(r, b);
+        render_attributes(r, b, true);
 
-                glUniform1i(r->uniform_is_color, !!font->is_color_font);
+        /* The backgrounds, the underlines, and then the cursor and such. */
+        glUniform1i(r->uniform_pass, 0);
+        glDrawArraysInstanced(GL_TRIANGLES, 0, 4 * 6, b->row * b->col);
 
-                glDrawArrays(GL_TRIANGLES, 0, font->num_cells_in_vbo * 6);
-        }
+        /* Then every glyph from every font. */
+        glUniform1i(r->uniform_pass, 1);
+        glDrawArraysInstanced(GL_TRIANGLES, 0, 6, b->row * b->col);
+
+        render_attributes(r, b, false);
+
+        /* This copy can be written again once the GPU is past here. */
+        if (r->persistent)
+                b->fence[b->copy] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+        return true;
+}
+
+/* Lets go of everything a row buffer holds, on the GPU and off it. */
+void render_free_rows(struct rowbuffer *b)
+{
+        for (int i = 0; i < RENDER_BUFFERS; i++)
+                if (b->fence[i]) glDeleteSync(b->fence[i]);
+
+        /* Deleting the buffer unmaps it too. */
+        glDeleteBuffers(1, &b->vbo);
+        glDeleteTextures(1, &b->bg_texture);
+
+        free(b->v);
+        free(b->bg);
+        free(b->built);
 }
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
+
 #include <GL/glew.h>
 #include <freetype/freetype.h>
 
@@ -8,6 +11,86 @@
 #include "sprite.h"
 
 struct wterm;
+struct grid;
+
+/*
+ * A rectangle drawn over the screen, `x` and `y` pixels from its top
+ * left.
+ */
+struct rect {
+        GLfloat x, y, w, h;
+        GLfloat color[3];
+};
+
+enum {
+        INSTANCE_LAYER     = 0xf,       /* The glyph's layer in its atlas */
+        INSTANCE_UNDERLINE = 1 << 4,
+        INSTANCE_GLYPH     = 1 << 5,    /* Whether there's a glyph at all */
+        INSTANCE_COLOR     = 1 << 6,    /* Whether it's in the color atlas */
+};
+
+/*
+ * What's drawn for a cell: its column and its row in the grid's ring,
+ * its glyph as an index into the font manager's sprites, some flags
+ * and its color. The vertex shader makes each quad from these and the
+ * sprite table.
+ */
+struct instance {
+        uint16_t x, y;
+        uint16_t sprite;
+        uint16_t flags;
+        uint8_t fg[4];
+};
+
+/*
+ * The cells of a wterm's screen, kept from one frame to the next. Each
+ * row in the grid's ring has a slice of `vbo` with an instance for each
+ * of its cells. Only the slices of rows which have changed are built
+ * and uploaded again, and since the vertex shader works out where each
+ * row goes from the grid's `head`, scrolling the whole screen doesn't
+ * touch them at all.
+ *
+ * The backgrounds are kept apart, as a texel for each cell in
+ * `bg_texture` with the rows in the same order. A background with no
+ * alpha isn't drawn.
+ *
+ * The slices are built in `v` and only copied to `vbo` just before
+ * they're drawn. With ARB_buffer_storage `vbo` holds RENDER_BUFFERS
+ * copies of them and stays mapped, and each frame draws from the next
+ * copy once the GPU has finished with it, copying in only the slices
+ * which have been built since it was last drawn from. Without it there
+ * is one copy, which is orphaned when every slice has to go up.
+ *
+ * While the view is scrolled back into the scrollback each slice is
+ * a row of the view instead, and they're all built again whenever
+ * anything changes.
+ */
+struct rowbuffer {
+        GLuint vbo;
+        struct instance *v;     /* Every slice */
+        unsigned long *built;   /* When each slice was last built */
+        unsigned long builds;
+
+        struct instance *map;
+        GLsync fence[RENDER_BUFFERS];
+        unsigned long written[RENDER_BUFFERS];
+        int copy;               /* The copy being drawn from */
+
+        GLuint bg_texture;
+        uint8_t (*bg)[4];       /* What's in it */
+
+        /* What the slices were last built from. */
+        struct grid *g;
+        int col, row, cw, ch, font_size;
+        int scroll;
+        long scrolled;
+        unsigned long frame;
+
+        /* The rest of what the framebuffer was last drawn with. */
+        int head;
+        struct rect decoration[2];
+        unsigned num_decoration;
+};
 
 struct font_renderer {
         /* Pointer to the global font manager. */
@@ -19,35 +102,57 @@ struct font_renderer {
 
         GLint ui_attribute_coord;
 
-        GLint attribute_coord;
-        GLint attribute_decoration_color;
-        GLint attribute_color;
+        GLint attribute_corner;
+        GLint attribute_cell;
+        GLint attribute_fg;
 
         GLint uniform_ui_tex;
         GLint uniform_ui_scale;
         GLint uniform_ui_offset;
 
-        GLint uniform_tex;
-        GLint uniform_is_solid;
-        GLint uniform_is_color;
+        GLint uniform_alpha;
+        GLint uniform_colors;
+        GLint uniform_sprites;
+        GLint uniform_backgrounds;
+        GLint uniform_pass;
+        GLint uniform_scale;
+        GLint uniform_size;
+        GLint uniform_pitch;
+        GLint uniform_head;
+        GLint uniform_rows;
+        GLint uniform_last;
+        GLint uniform_overlay;
+        GLint uniform_overlay_color;
 
         GLuint vbo_quad;
-        GLuint vbo_decoration;
-        GLuint vbo_decoration_color;
-        char *decoration;
-        char *decoration_color;
+        GLuint vbo_corner;
+
+        bool persistent;        /* Whether there's ARB_buffer_storage */
+
+        /*
+         * Where each sprite goes in its cell and where it is in its
+         * spritemap, for the vertex shader, and how many sprites have
+         * been put in it so far.
+         */
+        GLuint sprite_table;
+        int num_sprites;
+
+        /* The cursor and the paste progress bar. */
+        struct rect decoration[2];
         unsigned num_decoration;
 
         /* Width of height and window in pixels. */
         int width, height;
 
+        /*
+         * Every font's spritemap is a layer of one of two texture
+         * arrays, depending on whether it's a color font, so glyphs
+         * from every font can be drawn at once.
+         */
+        GLuint alpha_atlas, color_atlas;
+
         struct font_data {
-                GLuint sprite_texture;
-                GLuint vbo_vertices;
-                GLuint vbo_textures;
-                GLuint vbo_colors;
-                char *vertices, *textures, *colors;
-                int num_cells_in_vbo;
+                int layer;
                 int is_color_font;
                 struct font *font;
         } fonts[MAX_FONTS];
@@ -55,9 +160,11 @@ struct font_renderer {
         int num_fonts;
 
         struct color *color256;
+        uint8_t rgba256[256][4];        /* The same, as instances want them */
 };
 
 int render_init(struct font_renderer *r, struct font_manager *m, struct color *color256);
-void render_wterm(struct font_renderer *r, struct wterm *wt);
+bool render_wterm(struct font_renderer *r, struct wterm *wt);
+void render_free_rows(struct rowbuffer *b);
 void render_load_fonts(struct font_renderer *r);
 void render_quad(struct font_renderer *r, int x0, int y0, int x1, int y1, GLuint tex);
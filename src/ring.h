@@ -0,0 +1,147 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * A single-producer/single-consumer byte ring. Exactly one thread
+ * writes into it and exactly one other thread reads out of it, and
+ * neither of them ever takes a lock. `head` is only ever stored by
+ * the producer and `tail` only by the consumer, so all each side
+ * needs is to see the other's index with acquire/release ordering.
+ *
+ * The indices run freely and are masked on access, which is why the
+ * size has to be a power of two. `head - tail` is always the number
+ * of readable bytes, even after the indices wrap around.
+ */
+struct ring {
+        char *buf;
+        size_t size;
+        _Atomic size_t head;    /* Only stored by the producer. */
+        _Atomic size_t tail;    /* Only stored by the consumer. */
+};
+
+static inline int ring_init(struct ring *r, size_t size)
+{
+        r->buf = malloc(size);
+        r->size = size;
+        atomic_init(&r->head, 0);
+        atomic_init(&r->tail, 0);
+        return !r->buf;
+}
+
+static inline void ring_free(struct ring *r)
+{
+        free(r->buf);
+        r->buf = NULL;
+}
+
+/*
+ * The number of bytes waiting to be read. This is safe to call from
+ * either side, but it's only a snapshot; the other side may have
+ * moved on by the time it returns.
+ */
+static inline size_t ring_used(struct ring *r)
+{
+        size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+        size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+        return head - tail;
+}
+
+static inline size_t ring_space(struct ring *r)
+{
+        return r->size - ring_used(r);
+}
+
+/*
+ * Producer side. Returns the largest contiguous free region of the
+ * ring in `buf` and its length in `len`. Nothing becomes visible to
+ * the consumer until `ring_commit` is called.
+ */
+static inline char *ring_write_ptr(struct ring *r, size_t *len)
+{
+        size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+        size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+        size_t off = head & (r->size - 1);
+        size_t space = r->size - (head - tail);
+
+        *len = space < r->size - off ? space : r->size - off;
+
+        return r->buf + off;
+}
+
+/*
+ * Producer side. Like `ring_write_ptr`, but starts `skip` bytes past
+ * the head (bytes which have been written but not committed yet) and
+ * also returns the second free region, which is non-empty when the
+ * free space wraps around the end of the buffer. Returns the total
+ * free space after `skip`.
+ */
+static inline size_t ring_write_span(struct ring *r, size_t skip,
+                                     char **a, size_t *alen,
+                                     char **b, size_t *blen)
+{
+        size_t head = atomic_load_explicit(&r->head, memory_order_relaxed) + skip;
+        size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+        size_t off = head & (r->size - 1);
+        size_t space = r->size - (head - tail);
+
+        *a = r->buf + off;
+        *alen = space < r->size - off ? space : r->size - off;
+        *b = r->buf;
+        *blen = space - *alen;
+
+        return space;
+}
+
+static inline void ring_commit(struct ring *r, size_t n)
+{
+        size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+        atomic_store_explicit(&r->head, head + n, memory_order_release);
+}
+
+/*
+ * Producer side. Copies as much of `buf` as fits and returns the
+ * number of bytes that were copied.
+ */
+static inline size_t ring_put(struct ring *r, const char *buf, size_t n)
+{
+        size_t done = 0;
+
+        while (done < n) {
+                size_t len;
+                char *dst = ring_write_ptr(r, &len);
+                if (!len) break;
+                if (len > n - done) len = n - done;
+                memcpy(dst, buf + done, len);
+                ring_commit(r, len);
+                done += len;
+        }
+
+        return done;
+}
+
+/*
+ * Consumer side. Returns the largest contiguous readable region of
+ * the ring. The bytes stay owned by the consumer until they're
+ * released with `ring_consume`.
+ */
+static inline char *ring_read_ptr(struct ring *r, size_t *len)
+{
+        size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+        size_t off = tail & (r->size - 1);
+        size_t used = head - tail;
+
+        *len = used < r->size - off ? used : r->size - off;
+
+        return r->buf + off;
+}
+
+static inline void ring_consume(struct ring *r, size_t n)
+{
+        size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        atomic_store_explicit(&r->tail, tail + n, memory_order_release);
+}
@@ -0,0 +1,736 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "scrollback.h"
+#include "lz4.h"
+#include "term.h"
+#include "utf8.h"
+#include "util.h"
+
+/*
+ * A line is stored as
+ *
+ *     length of the rest of the line
+ *     flags (SB_*)
+ *     number of cells, not counting blank ones at the end
+ *     the characters, either as ASCII or UTF-8
+ *     number of runs of attributes
+ *     each run: its length, mode, fg and bg
+ *
+ * where the counts, lengths and colors are varints. A color is 0 for
+ * the default, 1-256 for the palette and 257 plus the RGB value for a
+ * truecolor.
+ */
+
+enum {
+        SB_WRAP  = 1 << 0,      /* The line goes on in the next one */
+        SB_ASCII = 1 << 1,      /* Every character is one byte */
+};
+
+static const struct cell blank = { .c = 0, .mode = 0, .fg = -1, .bg = -1 };
+
+/* The most a line of `n` cells can take up, without its length. */
+#define LINE_BOUND(n) (16 + 19 * (size_t)(n))
+
+/*
+ * A line which goes on for longer than this is stored a piece at a
+ * time, so that a program which never prints a newline can't make the
+ * pending line grow forever.
+ */
+#define PENDING_MAX (1 << 16)
+
+static char *put_varint(char *p, size_t v)
+{
+        for (; v >= 0x80; v >>= 7) *p++ = v | 0x80;
+        *p++ = v;
+        return p;
+}
+
+static const char *get_varint(const char *p, size_t *v)
+{
+        int shift = 0;
+
+        for (*v = 0; *p & 0x80; shift += 7)
+                *v |= (size_t)(*p++ & 0x7f) << shift;
+        *v |= (size_t)(uint8_t)*p++ << shift;
+
+        return p;
+}
+
+static char *put_color(char *p, struct palette *palette, int color)
+{
+        if (color >= 256) return put_varint(p, 257 + palette->rgb[color - 256]);
+        return put_varint(p, color + 1);
+}
+
+static const char *get_color(const char *p, struct palette *palette, int16_t *color)
+{
+        size_t v;
+
+        p = get_varint(p, &v);
+
+        if (v < 257) {
+                *color = (int)v - 1;
+        } else {
+                int c = palette_find(palette, v - 257);
+                *color = c >= 0 ? c : palette_cube(v - 257);
+        }
+
+        return p;
+}
+
+static bool same_attr(struct cell a, struct cell b)
+{
+        return a.mode == b.mode && a.fg == b.fg && a.bg == b.bg;
+}
+
+/* How many rows a line of `n` cells takes up at `col` wide. */
+static long line_rows(size_t n, int col)
+{
+        return n ? (n + col - 1) / col : 1;
+}
+
+/*
+ * Encodes `n` cells into `buf` and says how many were kept. Blank
+ * cells at the end are left out unless the line continues.
+ */
+static size_t encode(char *buf, struct palette *palette, const struct cell *line,
+                     size_t n, bool cont, size_t *kept)
+{
+        size_t ncell = n;
+        int flags = cont ? SB_WRAP : 0;
+
+        if (!cont)
+                while (ncell && !memcmp(line + ncell - 1, &blank, sizeof blank)) ncell--;
+
+        bool ascii = true;
+        for (size_t i = 0; i < ncell; i++)
+                if (line[i].c >= 0x80) ascii = false;
+        if (ascii) flags |= SB_ASCII;
+
+        char *p = buf;
+        *p++ = flags;
+        p = put_varint(p, ncell);
+
+        for (size_t i = 0; i < ncell; i++) {
+                unsigned len = 1;
+                if (ascii) *p = line[i].c;
+                else utf8encode(line[i].c, (uint8_t *)p, &len);
+                p += len;
+        }
+
+        size_t nrun = 0;
+        for (size_t i = 0; i < ncell; i++)
+                if (!i || !same_attr(line[i], line[i - 1])) nrun++;
+        p = put_varint(p, nrun);
+
+        for (size_t i = 0, j; i < ncell; i = j) {
+                for (j = i + 1; j < ncell && same_attr(line[j], line[i]); j++);
+
+                uint16_t mode = line[i].mode;
+                p = put_varint(p, j - i);
+                memcpy(p, &mode, 2), p += 2;
+                p = put_color(p, palette, line[i].fg);
+                p = put_color(p, palette, line[i].bg);
+        }
+
+        *kept = ncell;
+
+        return p - buf;
+}
+
+/* Reads how many cells a line has and its flags. */
+static const char *line_head(const char *p, size_t *ncell, int *flags)
+{
+        size_t len;
+
+        p = get_varint(p, &len);
+        *flags = *p++;
+
+        return get_varint(p, ncell);
+}
+
+/*
+ * Decodes `count` cells of a line starting from cell `start`, padded
+ * with blank cells past the end of the line.
+ */
+static void decode(const char *p, struct palette *palette, struct cell *line,
+                   size_t start, size_t count)
+{
+        size_t len, ncell, nrun;
+        int flags;
+
+        const char *end = get_varint(p, &len) + len;
+
+        p = line_head(p, &ncell, &flags);
+
+        for (size_t i = 0; i < count; i++) line[i] = blank;
+
+        if (flags & SB_ASCII) {
+                for (size_t i = start; i < ncell && i < start + count; i++)
+                        line[i - start].c = (uint8_t)p[i];
+                p += ncell;
+        } else {
+                for (size_t i = 0; i < ncell; i++) {
+                        uint32_t c;
+                        p += utf8decode(p, end - p, &c);
+                        if (i >= start && i < start + count) line[i - start].c = c;
+                }
+        }
+
+        p = get_varint(p, &nrun);
+
+        for (size_t i = 0, x = 0; i < nrun && x < start + count; i++) {
+                uint16_t mode;
+                int16_t fg, bg;
+
+                p = get_varint(p, &len);
+                memcpy(&mode, p, 2), p += 2;
+                p = get_color(p, palette, &fg);
+                p = get_color(p, palette, &bg);
+
+                size_t a = x > start ? x : start;
+                size_t b = x + len < start + count ? x + len : start + count;
+
+                for (size_t j = a; j < b; j++) {
+                        line[j - start].mode = mode;
+                        line[j - start].fg = fg;
+                        line[j - start].bg = bg;
+                }
+
+                x += len;
+        }
+}
+
+static void compress(struct scrollback *sb, struct sbpage *p)
+{
+        if (p->compressed) return;
+
+        size_t cap = LZ4_BOUND(p->len), n;
+        char *buf = malloc(cap);
+
+        /* If it can't be compressed it can stay as it is. */
+        if (!buf || !(n = lz4_compress(p->buf, p->len, buf, cap))) {
+                free(buf);
+                return;
+        }
+
+        char *shrunk = realloc(buf, n);
+        if (shrunk) buf = shrunk;
+
+        sb->bytes -= p->size + p->cap * sizeof *p->off;
+        sb->bytes += n;
+
+        free(p->buf);
+        free(p->off);
+        p->buf = buf;
+        p->size = n;
+        p->off = NULL;
+        p->cap = 0;
+        p->compressed = true;
+}
+
+/* Opens a new file to spill pages to. */
+static struct sbsegment *add_segment(struct scrollback *sb)
+{
+        if (sb->nseg == sb->segcap) {
+                int cap = sb->segcap ? sb->segcap * 2 : 16;
+                struct sbsegment *seg = realloc(sb->seg, cap * sizeof *seg);
+                if (!seg) return NULL;
+                sb->seg = seg;
+                sb->segcap = cap;
+        }
+
+        /* /tmp is often in memory, which would defeat the point. */
+        const char *dir = getenv("TMPDIR");
+        char path[4096];
+
+        snprintf(path, sizeof path, "%s/kty-scrollback-XXXXXX", dir && *dir ? dir : "/var/tmp");
+
+        int fd = mkstemp(path);
+        if (fd < 0) return NULL;
+
+        /* Nothing else needs to find it, and it goes away with us. */
+        unlink(path);
+
+        char *map;
+
+        if (ftruncate(fd, SCROLLBACK_SEGMENT)
+            || (map = mmap(NULL, SCROLLBACK_SEGMENT, PROT_READ | PROT_WRITE,
+                           MAP_SHARED, fd, 0)) == MAP_FAILED) {
+                _printf("Couldn't make a scrollback segment\n");
+                close(fd);
+                return NULL;
+        }
+
+        struct sbsegment *seg = sb->seg + sb->nseg++;
+        *seg = (struct sbsegment){ .fd = fd, .map = map };
+
+        return seg;
+}
+
+/*
+ * Lets go of the memory behind part of a segment. The pages are shared
+ * with the file, so they're still there to be read back later.
+ */
+static void release(char *p, size_t len)
+{
+        size_t page = sysconf(_SC_PAGESIZE);
+        uintptr_t a = (uintptr_t)p & ~(page - 1);
+        uintptr_t b = ((uintptr_t)p + len + page - 1) & ~(page - 1);
+
+        madvise((void *)a, b - a, MADV_DONTNEED);
+}
+
+/* Moves a compressed page out of memory and into a segment. */
+static bool spill(struct scrollback *sb, struct sbpage *p)
+{
+        if (!p->compressed || p->size > SCROLLBACK_SEGMENT) return false;
+
+        struct sbsegment *seg = sb->nseg ? sb->seg + sb->nseg - 1 : NULL;
+
+        if (!seg || seg->len + p->size > SCROLLBACK_SEGMENT)
+                if (!(seg = add_segment(sb))) return false;
+
+        memcpy(seg->map + seg->len, p->buf, p->size);
+        release(seg->map + seg->len, p->size);
+
+        sb->bytes -= p->size;
+        free(p->buf);
+        p->buf = NULL;
+        p->seg = sb->segbase + sb->nseg - 1;
+        p->at = seg->len;
+        seg->len += p->size;
+
+        return true;
+}
+
+static void evict(struct scrollback *sb)
+{
+        if (SCROLLBACK_SPILL)
+                while (sb->bytes > SCROLLBACK_BYTES && sb->nspill < sb->npage - 1
+                       && spill(sb, sb->page + sb->nspill))
+                        sb->nspill++;
+
+        /*
+         * Whatever still doesn't fit in memory is dropped along with
+         * everything older, as are the pages in the oldest segments
+         * once there are too many. The newest page always stays.
+         */
+        long keep = SCROLLBACK_SPILL_BYTES / SCROLLBACK_SEGMENT;
+        int n = 0;
+
+        for (; n < sb->npage - 1; n++) {
+                struct sbpage *p = sb->page + n;
+                bool old = n < sb->nspill && p->seg < sb->segbase + sb->nseg - keep;
+
+                if (!old && sb->bytes <= SCROLLBACK_BYTES) break;
+
+                if (p->buf) sb->bytes -= p->size + p->cap * sizeof *p->off;
+                free(p->buf);
+                free(p->off);
+        }
+
+        if (!n) return;
+
+        sb->look.col = 0;
+        memmove(sb->page, sb->page + n, (sb->npage - n) * sizeof *sb->page);
+        sb->npage -= n;
+        sb->nspill = n < sb->nspill ? sb->nspill - n : 0;
+        sb->first = sb->page[0].first;
+
+        /* Close the segments which no longer hold any pages. */
+        long oldest = sb->nspill ? sb->page[0].seg : sb->segbase + sb->nseg;
+        int k = oldest - sb->segbase;
+
+        for (int i = 0; i < k; i++) {
+                munmap(sb->seg[i].map, SCROLLBACK_SEGMENT);
+                close(sb->seg[i].fd);
+        }
+
+        memmove(sb->seg, sb->seg + k, (sb->nseg - k) * sizeof *sb->seg);
+        sb->nseg -= k;
+        sb->segbase += k;
+}
+
+static struct sbpage *add_page(struct scrollback *sb, size_t need)
+{
+        if (sb->npage == sb->cap) {
+                int cap = sb->cap ? sb->cap * 2 : 16;
+                struct sbpage *page = realloc(sb->page, cap * sizeof *page);
+                if (!page) return NULL;
+                sb->page = page;
+                sb->cap = cap;
+        }
+
+        size_t size = need > SCROLLBACK_PAGE ? need : SCROLLBACK_PAGE;
+        char *buf = malloc(size);
+        if (!buf) return NULL;
+
+        struct sbpage *p = sb->page + sb->npage++;
+
+        *p = (struct sbpage){
+                .buf = buf,
+                .size = size,
+                .first = sb->end,
+        };
+
+        sb->bytes += size;
+
+        if (sb->npage > SCROLLBACK_HOT)
+                compress(sb, sb->page + sb->npage - 1 - SCROLLBACK_HOT);
+
+        return p;
+}
+
+void scrollback_init(struct scrollback *sb, struct palette *palette)
+{
+        memset(sb, 0, sizeof *sb);
+        sb->palette = palette;
+        sb->cache[0].first = sb->cache[1].first = -1;
+}
+
+void scrollback_free(struct scrollback *sb)
+{
+        for (int i = 0; i < sb->npage; i++) {
+                free(sb->page[i].buf);
+                free(sb->page[i].off);
+        }
+
+        for (int i = 0; i < sb->nseg; i++) {
+                munmap(sb->seg[i].map, SCROLLBACK_SEGMENT);
+                close(sb->seg[i].fd);
+        }
+
+        for (int i = 0; i < 2; i++) {
+                free(sb->cache[i].buf);
+                free(sb->cache[i].off);
+        }
+
+        free(sb->page);
+        free(sb->seg);
+        free(sb->pending);
+        free(sb->scratch);
+        scrollback_init(sb, sb->palette);
+}
+
+/* Stores the pending line as the newest line. */
+static void store(struct scrollback *sb, int col, bool cont)
+{
+        size_t need = LINE_BOUND(sb->npending);
+
+        if (sb->scratchsize < need) {
+                char *scratch = realloc(sb->scratch, need);
+                if (!scratch) {
+                        sb->npending = 0;
+                        return;
+                }
+                sb->scratch = scratch;
+                sb->scratchsize = need;
+        }
+
+        size_t ncell, len = encode(sb->scratch, sb->palette, sb->pending,
+                                   sb->npending, cont, &ncell);
+        char head[8];
+        size_t hlen = put_varint(head, len) - head;
+
+        sb->npending = 0;
+
+        struct sbpage *p = sb->npage ? sb->page + sb->npage - 1 : NULL;
+
+        /* Lines taken back can leave a compressed page as the newest. */
+        if (!p || p->compressed || p->len + hlen + len > p->size)
+                if (!(p = add_page(sb, hlen + len))) return;
+
+        if (p->nline == p->cap) {
+                int cap = p->cap ? p->cap * 2 : 256;
+                uint32_t *off = realloc(p->off, cap * sizeof *off);
+                if (!off) return;
+                sb->bytes += (cap - p->cap) * sizeof *off;
+                p->off = off;
+                p->cap = cap;
+        }
+
+        p->off[p->nline++] = p->len;
+        memcpy(p->buf + p->len, head, hlen);
+        memcpy(p->buf + p->len + hlen, sb->scratch, len);
+        p->len += hlen + len;
+        if (p->width == col) p->rows += line_rows(ncell, col);
+        sb->end++;
+
+        evict(sb);
+}
+
+void scrollback_push(struct scrollback *sb, const struct cell *line, int col, bool wrap)
+{
+        if (sb->npending + col > sb->pendcap) {
+                int cap = sb->pendcap * 2 > sb->npending + col ? sb->pendcap * 2 : sb->npending + col;
+                struct cell *pending = realloc(sb->pending, cap * sizeof *pending);
+                if (!pending) return;
+                sb->pending = pending;
+                sb->pendcap = cap;
+        }
+
+        memcpy(sb->pending + sb->npending, line, col * sizeof *line);
+        sb->npending += col;
+        sb->look.col = 0;
+
+        if (!wrap || sb->npending >= PENDING_MAX) store(sb, col, wrap);
+}
+
+/* The lines in a page, decompressed if need be, and where each starts. */
+static const char *page_lines(struct scrollback *sb, struct sbpage *p, const uint32_t **off)
+{
+        if (!p->compressed) {
+                *off = p->off;
+                return p->buf;
+        }
+
+        struct sbcache *c = NULL;
+
+        for (int i = 0; i < 2; i++) {
+                if (sb->cache[i].first != p->first) continue;
+                c = sb->cache + i;
+                sb->lru = !i;
+        }
+
+        if (!c) {
+                c = sb->cache + sb->lru;
+                sb->lru = !sb->lru;
+                c->first = -1;
+
+                if (c->size < p->len) {
+                        char *buf = realloc(c->buf, p->len);
+                        if (!buf) return NULL;
+                        c->buf = buf;
+                        c->size = p->len;
+                }
+
+                if (c->cap < p->nline) {
+                        uint32_t *off = realloc(c->off, p->nline * sizeof *off);
+                        if (!off) return NULL;
+                        c->off = off;
+                        c->cap = p->nline;
+                }
+
+                /* Read it back from disk if it's been spilled. */
+                const char *src = p->buf ? p->buf
+                        : sb->seg[p->seg - sb->segbase].map + p->at;
+                size_t len = lz4_decompress(src, p->size, c->buf, p->len);
+
+                if (!p->buf) release((char *)src, p->size);
+                if (len != p->len) return NULL;
+
+                for (size_t i = 0, o = 0; (int)i < p->nline; i++) {
+                        c->off[i] = o;
+                        o = get_varint(c->buf + o, &len) - c->buf + len;
+                }
+
+                c->first = p->first;
+        }
+
+        *off = c->off;
+
+        return c->buf;
+}
+
+static const char *line_at(struct scrollback *sb, int page, int line)
+{
+        const uint32_t *off;
+        const char *buf = page_lines(sb, sb->page + page, &off);
+
+        return buf ? buf + off[line] : NULL;
+}
+
+static long rows_at(struct scrollback *sb, int page, int line, int col)
+{
+        const char *p = line_at(sb, page, line);
+        size_t ncell;
+        int flags;
+
+        if (!p) return 1;
+        line_head(p, &ncell, &flags);
+
+        return line_rows(ncell, col);
+}
+
+static long page_rows(struct scrollback *sb, struct sbpage *p, int col)
+{
+        if (p->width == col) return p->rows;
+
+        const uint32_t *off;
+        const char *buf = page_lines(sb, p, &off);
+
+        if (!buf) return p->nline;
+
+        p->rows = 0;
+        p->width = col;
+
+        for (int i = 0; i < p->nline; i++) {
+                size_t ncell;
+                int flags;
+                line_head(buf + off[i], &ncell, &flags);
+                p->rows += line_rows(ncell, col);
+        }
+
+        return p->rows;
+}
+
+static long pending_rows(struct scrollback *sb, int col)
+{
+        return sb->npending ? line_rows(sb->npending, col) : 0;
+}
+
+/*
+ * The number of rows the scrollback takes up at `col` wide, counting
+ * back from the newest no further than `max`.
+ */
+long scrollback_rows(struct scrollback *sb, int col, long max)
+{
+        long rows = pending_rows(sb, col);
+
+        for (int i = sb->npage - 1; i >= 0 && rows < max; i--)
+                rows += page_rows(sb, sb->page + i, col);
+
+        return rows < max ? rows : max;
+}
+
+/*
+ * Finds the line which has row `n` back from the newest, and which of
+ * its rows that is, starting from wherever the last row was found.
+ */
+static bool find_row(struct scrollback *sb, long n, int col, int *page, int *line, long *row)
+{
+        if (!sb->npage) return false;
+
+        if (sb->look.col != col) {
+                sb->look.col = col;
+                sb->look.page = sb->npage - 1;
+                sb->look.line = sb->page[sb->npage - 1].nline - 1;
+                sb->look.base = pending_rows(sb, col);
+        }
+
+        int pg = sb->look.page, ln = sb->look.line;
+        long base = sb->look.base;
+
+        while (n < base) {
+                if (++ln == sb->page[pg].nline) pg++, ln = 0;
+                base -= rows_at(sb, pg, ln, col);
+        }
+
+        for (long r; n >= base + (r = rows_at(sb, pg, ln, col));) {
+                base += r;
+                if (--ln >= 0) continue;
+                if (--pg < 0) return false;
+
+                /* Skip past whole pages when they're too new. */
+                while (pg > 0 && n >= base + page_rows(sb, sb->page + pg, col))
+                        base += page_rows(sb, sb->page + pg--, col);
+
+                ln = sb->page[pg].nline - 1;
+        }
+
+        sb->look.page = *page = pg;
+        sb->look.line = *line = ln;
+        sb->look.base = base;
+        *row = rows_at(sb, pg, ln, col) - 1 - (n - base);
+
+        return true;
+}
+
+/*
+ * Reads row `n` back from the newest at `col` wide into `line`, and
+ * whether it wraps onto the next. Returns false if there's no such
+ * row.
+ */
+bool scrollback_line(struct scrollback *sb, long n, struct cell *line, int col, bool *wrap)
+{
+        if (n < 0) return false;
+
+        long prows = pending_rows(sb, col);
+
+        if (n < prows) {
+                long start = (prows - 1 - n) * col;
+                for (int i = 0; i < col; i++)
+                        line[i] = start + i < sb->npending ? sb->pending[start + i] : blank;
+                if (wrap) *wrap = true;
+                return true;
+        }
+
+        int page, ln;
+        long row;
+
+        if (!find_row(sb, n, col, &page, &ln, &row)) return false;
+
+        const char *p = line_at(sb, page, ln);
+        if (!p) return false;
+
+        size_t ncell;
+        int flags;
+
+        line_head(p, &ncell, &flags);
+        decode(p, sb->palette, line, row * col, col);
+
+        if (wrap) *wrap = row < line_rows(ncell, col) - 1 || flags & SB_WRAP;
+
+        return true;
+}
+
+/*
+ * Takes back the start of the line which hasn't ended yet, so that it
+ * can be joined back up with the rest of it. The caller frees it.
+ */
+int scrollback_unpend(struct scrollback *sb, struct cell **cells)
+{
+        int n = sb->npending;
+
+        *cells = sb->pending;
+        sb->pending = NULL;
+        sb->npending = sb->pendcap = 0;
+        sb->look.col = 0;
+
+        return n;
+}
+
+/*
+ * Takes the newest line back out of the scrollback. Returns its cells,
+ * which the caller frees, or NULL if there's none to take back. Lines
+ * which have been compressed stay where they are.
+ */
+struct cell *scrollback_pop(struct scrollback *sb, int *len, bool *wrap)
+{
+        if (!sb->npage || sb->npending) return NULL;
+
+        struct sbpage *p = sb->page + sb->npage - 1;
+        if (p->compressed) return NULL;
+
+        const char *rec = p->buf + p->off[p->nline - 1];
+        size_t ncell;
+        int flags;
+
+        line_head(rec, &ncell, &flags);
+
+        struct cell *cells = malloc((ncell ? ncell : 1) * sizeof *cells);
+        if (!cells) return NULL;
+
+        decode(rec, sb->palette, cells, 0, ncell);
+        *len = ncell;
+        *wrap = flags & SB_WRAP;
+
+        p->len = p->off[--p->nline];
+        p->width = 0;
+        sb->end--;
+        sb->look.col = 0;
+
+        if (!p->nline) {
+                sb->bytes -= p->size + p->cap * sizeof *p->off;
+                free(p->buf);
+                free(p->off);
+                if (!--sb->npage) sb->first = sb->end;
+        }
+
+        return cells;
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct cell;
+struct palette;
+
+/*
+ * Lines which have scrolled off the top of the primary screen. Each
+ * line is encoded as its text followed by its attributes as runs, and
+ * lines are packed into pages. The newest few pages are left as they
+ * are so that pushing a line is only a copy; older ones are compressed
+ * and only decompressed again to be read. Once the pages take up more
+ * than `SCROLLBACK_BYTES` the oldest ones are dropped, or with
+ * `SCROLLBACK_SPILL` written out to disk and only read back if the
+ * view is scrolled that far.
+ *
+ * Rows come in one at a time but are kept as logical lines, the rows
+ * joined by wrapping, so that the history doesn't have to be rewrapped
+ * whenever the width changes. Which rows a line takes up at a given
+ * width is only worked out as the view gets to it, and each page
+ * remembers how many rows it took up at the last width asked for.
+ *
+ * Lines are numbered from when the terminal started, so a line keeps
+ * its number as lines are pushed and dropped around it.
+ *
+ * Truecolors are kept as they are rather than as indices into the
+ * term's `palette`, so that the palette only has to hold the colors
+ * on the screen. They're found in it again as lines are read back.
+ */
+struct sbpage {
+        char *buf;              /* The lines, compressed or not */
+        size_t len;             /* The size of the lines uncompressed */
+        size_t size;            /* The size of `buf` */
+        uint32_t *off;          /* Where each line starts, if uncompressed */
+        int nline, cap;
+        long first;             /* The number of the first line */
+        bool compressed;
+
+        long rows;              /* How many rows the lines take up... */
+        int width;              /* ...at this width, or 0 if unknown */
+
+        /* Where it is on disk, if `buf` is NULL. */
+        long seg;
+        size_t at;
+};
+
+struct scrollback {
+        struct palette *palette;
+        struct sbpage *page;    /* Oldest first */
+        int npage, cap;
+
+        long first, end;        /* The first line kept and one past the last */
+        size_t bytes;           /* How much memory the pages hold */
+
+        /* The start of a line which hasn't ended yet. */
+        struct cell *pending;
+        int npending, pendcap;
+
+        char *scratch;          /* Where lines are encoded */
+        size_t scratchsize;
+
+        /*
+         * Where the last row looked up was: `base` rows back from the
+         * newest is the last row of `line` in `page`. Reading the
+         * rows in order only has to step from one line to the next.
+         */
+        struct {
+                int col, page, line;
+                long base;
+        } look;
+
+        /*
+         * The files pages are spilled to with SCROLLBACK_SPILL. The
+         * first `nspill` pages are on disk, in order, so the oldest
+         * segment only holds pages which are older than the rest.
+         */
+        struct sbsegment {
+                int fd;
+                char *map;
+                size_t len;
+        } *seg;
+        int nseg, segcap;
+        long segbase;           /* The number of `seg[0]` */
+        int nspill;
+
+        /* The last couple of compressed pages to be read. */
+        struct sbcache {
+                long first;     /* The page's first line, or -1 */
+                char *buf;
+                size_t size;
+                uint32_t *off;
+                int cap;
+        } cache[2];
+        int lru;
+};
+
+void scrollback_init(struct scrollback *sb, struct palette *palette);
+void scrollback_free(struct scrollback *sb);
+void scrollback_push(struct scrollback *sb, const struct cell *line, int col, bool wrap);
+long scrollback_rows(struct scrollback *sb, int col, long max);
+bool scrollback_line(struct scrollback *sb, long n, struct cell *line, int col, bool *wrap);
+int scrollback_unpend(struct scrollback *sb, struct cell **cells);
+struct cell *scrollback_pop(struct scrollback *sb, int *len, bool *wrap);
@@ -3,31 +3,28 @@
 #include "t.h"
 
 #include <inttypes.h>                  /* PRIx32 */
+#include <limits.h>                    /* LONG_MAX */
 #include <stdint.h>                    /* uint32_t */
 #include <stdio.h>                     /* fprintf, stderr */
 #include <stdlib.h>                    /* realloc, atoi, calloc */
 #include <string.h>                    /* memmove, memset */
-#include <wchar.h>                     /* wcwidth */
 #include <unistd.h>
 
 #include "esc.h"
 #include "font.h"                      /* cell, CELL_BOLD, CELL_DUMMY */
 #include "term.h"                      /* term, cursor, term::(anonymous) */
 #include "render.h"                    /* font_renderer */
-#include "utf8.h"                      /* utf8decode, utf8encode */
-#include "util.h"                      /* _printf, ESC_ARG_SIZE, ISCONTROL */
+#include "utf8.h"                      /* utf8transcode, utf8encode */
+#include "util.h"                      /* _printf, ESC_ARG_SIZE */
+#include "wcwidth.h"                   /* kty_wcwidth */
 #include "platform.h"
 
-#define ISCONTROLC0(c) ((0 < c && c < 0x1f) || (c) == 0x7f)
-#define ISCONTROLC1(c) (0x80 < c && c < 0x9f)
-#define ISCONTROL(c) (ISCONTROLC0(c) || ISCONTROLC1(c))
-
 void tswapscreen(struct term *t);
 int twrite(struct term *t, const char *buf, int buflen);
 void tputc(struct term *t, uint32_t c);
 void tcontrolcode(struct term *t, uint32_t c);
 void tnewline(struct term *t, int first_col);
-void tscrollup(struct term *t, int orig, int n);
+void tscrollup(struct term *t, int orig, int n, bool keep);
 void tscrolldown(struct term *t, int orig, int n);
 void tsetscroll(struct term *t, int top, int bot);
 void tmoveato(struct term *t, int x, int y);
@@ -37,12 +34,12 @@ void tprintc(struct term *t, uint32_t c);
 void tresize(struct term *t, int col, int row);
 void tdeletechar(struct term *t, int n);
 void tinsertblank(struct term *t, int n);
-void tstrsequence(struct term *t, unsigned char c);
+void tstrsequence(struct term *t, uint32_t c);
 void tstrhandle(struct term *t);
 void tsetattr(struct term *t);
 void tcursor(struct term *t, int save);
 void tcsihandle(struct term *t, struct csi *csi);
-int teschandle(struct term *t, uint32_t c);
+void teschandle(struct term *t, uint32_t c);
 void handle_gridinal_mode(struct term *t, int set, bool priv);
 
 enum {
@@ -69,254 +66,265 @@ void tcursor(struct term *t, int save)
         else t->c[0] = t->c[1];
 }
 
+static const struct cell blank = { .c = 0, .mode = 0, .fg = -1, .bg = -1 };
+
 /*
- * Grow the buffers representing the grid to accomodate the new
- * dimensions `col` x `row`. It doesn't update the cursor position or
- * anything else.
+ * Note that columns `x0` to `x1` of row `y` of the screen have changed
+ * in this frame.
  */
-static void tgrow(struct term *t, int col, int row)
+static void tdamage(struct term *t, int y, int x0, int x1)
 {
-        struct grid *g = t->g;
+        struct damage *d = t->g->damage + ROW(t->g, y);
 
-        if (row > g->row) {
-                g->line = realloc(g->line, row * sizeof *g->line);
-                g->attr = realloc(g->attr, row * sizeof *g->attr);
-                g->wrap = realloc(g->wrap, row * sizeof *g->wrap);
-
-                /*
-                 * The reason we use `max(col, g->col)` here is to
-                 * ensure that all lines have _at least_ enough for
-                 * the original size (i.e. never shrinking a line
-                 * buffer) but also being big enough to accomodate
-                 * `col` columns.
-                 *
-                 * If we were to just allocate `col` then horizontally
-                 * shrinking would truncate the lines, destroying the
-                 * information needed to wrap the text. Just
-                 * allocating `g->col` wouldn't be enough if
-                 * horizontally growing.
-                 *
-                 * Of course that's bullshit because these lines are
-                 * being added to the end after vertical growth, but
-                 * basically it would require special cases in `twrap`
-                 * otherwise. `twrap` assumes that all lines can be
-                 * read to the original width. So just close your eyes
-                 * and imagine that the two paragraphs above are true
-                 * for this case and it makes sense; `twrap` doesn't
-                 * know they're not true.
-                 */
-
-#define max(x,y) (x > y ? x : y)
-
-                for (int i = g->row; i < row; i++) {
-                        g->line[i] = calloc(max(col, g->col), sizeof **g->line);
-                        g->attr[i] = calloc(max(col, g->col), sizeof **g->attr);
-                        g->wrap[i] = 0;
-                }
+        if (d->frame != t->frame) {
+                d->frame = t->frame;
+                d->x0 = x0;
+                d->x1 = x1;
+                return;
         }
 
-        if (col > g->col)
-                for (int i = 0; i < row; i++) {
-                        g->line[i] = realloc(g->line[i], col * sizeof **g->line);
-                        memset(g->line[i] + g->col, 0, (col - g->col) * sizeof **g->line);
-
-                        g->attr[i] = realloc(g->attr[i], col * sizeof **g->attr);
-                        memset(g->attr[i] + g->col, 0, (col - g->col) * sizeof **g->attr);
-                }
+        if (x0 < d->x0) d->x0 = x0;
+        if (x1 > d->x1) d->x1 = x1;
 }
 
-static void twrap(struct term *t, int col, int row)
+/*
+ * Rows are written into a new grid one cell at a time and wrapped at
+ * its width. The grid is used as a ring: once it's full each new row
+ * takes the place of the oldest one, which goes to the scrollback if
+ * there is one. `y` counts every row started so far, and no row is
+ * started past `limit`.
+ */
+struct reflow {
+        struct grid *g;
+        struct scrollback *sb;
+        long y, limit;
+        int x;
+        bool started;
+};
+
+static void reflow_row(struct reflow *r)
 {
-        struct grid *g = t->g;
+        struct grid *g = r->g;
+        int i = r->y % g->row;
 
-        bool wrapped[row];
-        memset(wrapped, 0, sizeof wrapped);
+        if (r->y >= g->row && r->sb)
+                scrollback_push(r->sb, g->line[i], g->col, g->wrap[i]);
 
-        if (col > g->col) {
-                for (int i = 0; i < row; i++) {
-                        struct { int x, y; } a = { 0, i }, b = a;
+        for (int j = 0; j < g->col; j++) g->line[i][j] = blank;
+        g->wrap[i] = false;
 
-                        int endofblock = i;
+        r->x = 0;
+        r->started = true;
+}
 
-                        while (g->wrap[endofblock] && endofblock < row) endofblock++;
+static void reflow_put(struct reflow *r, struct cell c)
+{
+        struct grid *g = r->g;
+
+        if (!r->started) {
+                if (r->y >= r->limit) return;
+                reflow_row(r);
+        } else if (r->x == g->col) {
+                if (r->y + 1 >= r->limit) return;
+                g->wrap[r->y % g->row] = true;
+                r->y++;
+                reflow_row(r);
+        }
 
-                        int lastlineupdated = a.y;
+        g->line[r->y % g->row][r->x++] = c;
+}
 
-                        while ((b.y && g->wrap[b.y - 1]) || (b.y == i && g->wrap[i])) {
-                                if (b.y >= row || a.y >= row) break;
+static void reflow_end(struct reflow *r)
+{
+        if (!r->started) {
+                if (r->y >= r->limit) return;
+                reflow_row(r);
+        }
 
-                                g->line[a.y][a.x] = g->line[b.y][b.x];
-                                g->attr[a.y][a.x] = g->attr[b.y][b.x];
+        r->y++;
+        r->started = false;
+}
 
-                                if (g->line[b.y][b.x])
-                                        lastlineupdated = a.y;
+/*
+ * How much of row `i` belongs to its logical line: all of it if it
+ * wraps, and otherwise up to the last cell which isn't blank or the
+ * cursor, whichever is further.
+ */
+static int trowlen(struct term *t, int i)
+{
+        struct grid *g = t->g;
+        struct cell *l = g->line[ROW(g, i)];
+        int len = g->col;
 
-                                if (a.x != b.x || a.y != b.y) {
-                                        g->line[b.y][b.x] = 0;
-                                        g->attr[b.y][b.x] = (struct cell_attr){ 0 };
-                                }
+        if (!g->wrap[ROW(g, i)])
+                while (len && !memcmp(l + len - 1, &blank, sizeof blank)) len--;
 
-                                a.x++;
-                                b.x++;
+        if (i == t->c->y && len <= LIMIT(t->c->x, 0, g->col - 1))
+                len = LIMIT(t->c->x, 0, g->col - 1) + 1;
 
-                                if (a.x == col) {
-                                        wrapped[a.y] = true;
-                                        a.x = 0;
-                                        a.y++;
-                                }
+        return len;
+}
 
-                                if (b.x == g->col) {
-                                        b.x = 0;
-                                        b.y++;
-                                }
+/*
+ * Rebuild the grid at `col` x `row` from its logical lines, the runs
+ * of rows joined by `wrap`. Everything is done in one pass over the
+ * cells into a fresh grid, and the cursor is carried along to the
+ * same character it was on.
+ *
+ * On the primary screen a line which starts in the scrollback is
+ * joined back up with its start, and lines come back out of the
+ * scrollback when the screen gets taller. The rest of the scrollback
+ * is left as it is; it's wrapped to the new width as it's viewed.
+ *
+ * Returns nonzero if there wasn't the memory for it, in which case the
+ * grid is left as it was.
+ */
+static int treflow(struct term *t, int col, int row)
+{
+        struct grid *g = t->g;
+        size_t size = row * (sizeof (struct damage) + sizeof (struct cell *)
+                             + col * sizeof (struct cell) + sizeof (bool));
 
-                                if (!((b.y && g->wrap[b.y - 1]) || (b.y == i && g->wrap[i]))) {
-                                        b.y++;
-                                        break;
-                                }
-                        }
+        /*
+         * Build the new grid in the block the last one was built in if
+         * it's big enough, so that dragging the window around only has
+         * to allocate when it gets bigger than it's been.
+         */
+        struct damage *damage = g->spare;
 
-                        for (int j = i; j < lastlineupdated; j++)
-                                wrapped[j] = true;
+        if (g->sparesize < size) {
+                if (!(damage = malloc(size))) return 1;
+                free(g->spare);
+                g->spare = NULL;
+                g->sparesize = 0;
+        } else {
+                size = g->sparesize;
+        }
 
-                        for (int j = lastlineupdated; j <= a.y; j++)
-                                wrapped[j] = false;
+        struct cell **line = (struct cell **)(damage + row);
+        struct cell *cells = (struct cell *)(line + row);
+        struct grid new = *g;
+
+        new.damage = damage;
+        new.line = line;
+        new.size = size;
+        new.spare = g->damage;
+        new.sparesize = g->size;
+        new.wrap = (bool *)(cells + (size_t)row * col);
+        new.head = 0;
+        new.row = row;
+        new.col = col;
+        new.reset = t->frame;
+
+        for (int i = 0; i < row; i++) {
+                line[i] = cells + (size_t)i * col;
+                for (int j = 0; j < col; j++) line[i][j] = blank;
+                new.wrap[i] = false;
+                new.damage[i] = (struct damage){ 0 };
+        }
 
-                        for (int j = 0; j <= a.y; j++) {
-                                g->wrap[j] = false;
-                        }
+        struct scrollback *sb = g == t->grid ? &t->scrollback : NULL;
+        struct reflow r = { .g = &new, .sb = sb, .limit = LONG_MAX };
 
-                        for (int j = 0; j < endofblock - lastlineupdated; j++) {
-                                tscrollup(t, lastlineupdated + 1, 1);
-                                if (t->c->y > lastlineupdated + 1) t->c->y--;
-                        }
+        /* Blank rows below the cursor and everything else are dropped. */
+        int last = t->c->y;
 
-                        i = lastlineupdated;
-                }
-        } else if (col < g->col) {
-                /*
-                 * If we're shrinking horizontally then lines which
-                 * are currently considered wrapped should remain so.
-                 */
-                /* memcpy(wrapped, g->wrap, sizeof wrapped); */
-
-                for (int i = 0; i < row; i++) {
-                        int eol = 0;
-
-                        for (int j = g->col - 1; j >= col; j--)
-                                if (g->line[i][j]) {
-                                        eol = j;
-                                        break;
-                                }
-
-                        /* if (eol < col) continue; */
-
-                        struct { int x, y; } a = { 0, i }, b = a;
-
-                        uint32_t line[g->col];
-                        struct cell_attr attr[g->col];
-                        memcpy(line, g->line[i], sizeof line);
-                        memcpy(attr, g->attr[i], sizeof attr);
-
-                        if (!g->wrap[a.y] && eol >= col) {
-                                for (int j = 0; j <= eol; j++) {
-                                        g->line[a.y][a.x] = line[b.x];
-                                        g->attr[a.y][a.x] = attr[b.x];
-
-                                        if (b.y >= 0 && (a.x != b.x || a.y != b.y)) {
-                                                g->line[b.y][b.x] = 0;
-                                                g->attr[b.y][b.x] = (struct cell_attr){ 0 };
-                                        }
-
-                                        a.x++;
-                                        b.x++;
-
-                                        if (a.x == col) {
-                                                tscrolldown(t, a.y + 1, 1);
-                                                if (t->c->y >= a.y) t->c->y++;
-                                                a.x = 0;
-                                                a.y++;
-                                                if (a.y >= row) break;
-                                                memset(g->line[a.y], 0, col * sizeof **g->line);
-                                                memset(g->attr[a.y], 0, col * sizeof **g->attr);
-                                        }
-                                }
-
-                                for (int j = i; j < a.y; j++)
-                                        wrapped[j] = true;
-
-                                i = a.y;
-                                continue;
+        for (int i = t->c->y + 1; i < g->row; i++) {
+                if (g->wrap[ROW(g, i)]) last = i;
+                for (int j = 0; j < g->col; j++)
+                        if (memcmp(g->line[ROW(g, i)] + j, &blank, sizeof blank)) {
+                                last = i;
+                                break;
                         }
+        }
 
-                        if (!g->wrap[i]) continue;
+        struct cell *pending = NULL, *back[row];
+        int npending = 0, nback = 0, backlen[row];
+        bool backwrap[row];
 
-                        /*
-                         * If we reach this point then we're looking
-                         * at a wrapped line. The sequence of wrapped
-                         * lines may be long.
-                         */
+        if (sb) {
+                npending = scrollback_unpend(sb, &pending);
 
-                        int endofblock = i;
+                /* See how many rows are left over once the screen is wrapped. */
+                long need = row, n = npending;
 
-                        while (g->wrap[endofblock] && endofblock < row) endofblock++;
+                for (int i = 0; i <= last && i < g->row; i++) {
+                        n += trowlen(t, i);
+                        if (g->wrap[ROW(g, i)] && i != last) continue;
+                        need -= n ? (n + col - 1) / col : 1;
+                        n = 0;
+                }
 
-                        int numlines = endofblock - i + 1;
+                while (need > 0 && nback < row
+                       && (back[nback] = scrollback_pop(sb, backlen + nback, backwrap + nback))) {
+                        need -= backlen[nback] ? (backlen[nback] + col - 1) / col : 1;
+                        nback++;
+                }
+        }
 
-                        uint32_t **block = malloc(numlines * sizeof *block);
-                        struct cell_attr **attrblock = malloc(numlines * sizeof *attrblock);
+        /* Where the current logical line starts, and how long it is so far. */
+        long start = 0;
+        int off = 0;
 
-                        for (int j = 0; j < numlines; j++) {
-                                block[j] = malloc(g->col * sizeof **block);
-                                memcpy(block[j], g->line[i + j], g->col * sizeof **block);
+        while (nback--) {
+                for (int j = 0; j < backlen[nback]; j++) reflow_put(&r, back[nback][j]);
+                off += backlen[nback];
+                free(back[nback]);
 
-                                attrblock[j] = malloc(g->col * sizeof **attrblock);
-                                memcpy(attrblock[j], g->attr[i + j], g->col * sizeof **attrblock);
-                        }
+                if (!backwrap[nback]) {
+                        reflow_end(&r);
+                        start = r.y;
+                        off = 0;
+                }
+        }
 
-                        while (b.y <= endofblock && a.y < row && b.y < row) {
-                                int eol = 0;
+        for (int j = 0; j < npending; j++) reflow_put(&r, pending[j]);
+        off += npending;
+        free(pending);
 
-                                for (int j = g->col - 1; j >= 0; j--)
-                                        if (block[b.y - i][j]) {
-                                                eol = j;
-                                                break;
-                                        }
+        long cy = 0;
+        int cx = 0;
 
-                                if (b.y == endofblock && b.x > eol) break;
+        for (int i = 0; i <= last && i < g->row; i++) {
+                struct cell *l = g->line[ROW(g, i)];
+                bool wrap = g->wrap[ROW(g, i)];
+                int len = trowlen(t, i);
 
-                                g->line[a.y][a.x] = block[b.y - i][b.x];
-                                g->attr[a.y][a.x] = attrblock[b.y - i][b.x];
+                if (i == t->c->y) {
+                        int x = LIMIT(t->c->x, 0, g->col - 1);
+                        cy = start + (off + x) / col;
+                        cx = (off + x) % col;
 
-                                a.x++;
-                                b.x++;
+                        /* What doesn't fit below the cursor is lost. */
+                        r.limit = cy + row;
+                }
 
-                                if (a.x == col) {
-                                        a.x = 0;
-                                        a.y++;
+                for (int j = 0; j < len; j++) reflow_put(&r, l[j]);
 
-                                        if (a.y >= endofblock + 1) {
-                                                tscrolldown(t, a.y, 1);
-                                                memset(g->line[a.y], 0, col * sizeof **g->line);
-                                                memset(g->attr[a.y], 0, col * sizeof **g->attr);
-                                                if (t->c->y >= a.y) t->c->y++;
-                                        }
-                                }
+                off += len;
 
-                                if (b.x == g->col) {
-                                        b.x = 0;
-                                        b.y++;
-                                }
-                        }
+                if (!wrap) {
+                        reflow_end(&r);
+                        start = r.y;
+                        off = 0;
+                }
+        }
 
-                        for (int j = i; j < a.y; j++)
-                                wrapped[j] = true;
+        /* A wrapped line at the very bottom has nothing to end it. */
+        if (r.started) reflow_end(&r);
 
-                        i = a.y - 1;
-                }
+        if (r.y > row) {
+                new.head = r.y % row;
+                cy -= r.y - row;
         }
 
-        memcpy(g->wrap, wrapped, sizeof wrapped);
+        *g = new;
+
+        t->c->x = cx;
+        t->c->y = cy;
+        t->scroll = 0;
+
+        return 0;
 }
 
 void tresize(struct term *t, int col, int row)
@@ -330,13 +338,9 @@ void tresize(struct term *t, int col, int row)
         /* Save a little effort. */
         if (g->col == col && g->row == row) return;
 
-        t->c->x = LIMIT(t->c->x, 0, col - 1);
-        t->c->y = LIMIT(t->c->y, 0, row - 1);
+        /* Stay the size it was if it can't be any other. */
+        if (treflow(t, col, row)) return;
 
-        tgrow(t, col, row);
-        twrap(t, col, row);
-        g->col = col;
-        g->row = row;
         tsetscroll(t, 0, row - 1);
 
         t->c->x = LIMIT(t->c->x, 0, col - 1);
@@ -347,10 +351,11 @@ void tprintc(struct term *t, uint32_t c)
 {
         struct grid *g = t->g;
         _printf("U+%"PRIX32"\n", c);
-        int mode = t->c->mode | (wcwidth(c) == 2 ? CELL_WIDE : 0);
+        int width = kty_wcwidth(c);
+        int mode = t->c->mode | (width == 2 ? CELL_WIDE : 0);
 
         if (t->c->x >= g->col) {
-                g->wrap[t->c->y] = true;
+                g->wrap[ROW(g, t->c->y)] = true;
                 _printf("wrapping %d\n", t->c->y);
                 mode |= CELL_WRAP;
                 t->c->x = 0;
@@ -367,23 +372,24 @@ void tprintc(struct term *t, uint32_t c)
                         t->c->y--;
                         diff--;
                 }
-                tscrollup(t, 0, abs(diff));
+                tscrollup(t, 0, abs(diff), true);
         }
 
-        g->line[t->c->y][t->c->x] = c;
-        g->attr[t->c->y][t->c->x] = (struct cell_attr){
+        g->line[ROW(g, t->c->y)][t->c->x] = (struct cell){
+                .c = c,
                 .mode = mode,
                 .fg = t->c->fg,
                 .bg = t->c->bg,
         };
+        tdamage(t, t->c->y, t->c->x, t->c->x);
 
         t->c->x++;
 
-        if (wcwidth(c) > 1) {
+        if (width > 1) {
                 int wrapped = 0;
 
                 if (t->c->x >= g->col) {
-                        g->wrap[t->c->y] = true;
+                        g->wrap[ROW(g, t->c->y)] = true;
                         wrapped = CELL_WRAP;
                         t->c->x = 0;
                         t->c->y++;
@@ -396,13 +402,13 @@ void tprintc(struct term *t, uint32_t c)
                                 t->c->y--;
                                 diff--;
                         }
-                        tscrollup(t, 0, abs(diff));
+                        tscrollup(t, 0, abs(diff), true);
                 }
 
-                g->line[t->c->y][t->c->x] = 0;
-                g->attr[t->c->y][t->c->x] = (struct cell_attr){
+                g->line[ROW(g, t->c->y)][t->c->x] = (struct cell){
                         .mode = CELL_DUMMY | wrapped,
                 };
+                tdamage(t, t->c->y, t->c->x, t->c->x);
 
                 t->c->x++;
         }
@@ -411,24 +417,74 @@ void tprintc(struct term *t, uint32_t c)
                 t->c->mode |= CELL_WRAPNEXT;
 }
 
+/*
+ * Print a run of printable ASCII. This does exactly what calling
+ * `tprintc` on each character would, a line at a time: none of these
+ * characters are wide, so nothing but wrapping can happen in the
+ * middle of a run.
+ */
+static void tprintascii(struct term *t, const char *s, int n)
+{
+        struct grid *g = t->g;
+
+        while (n) {
+                int wrapped = 0;
+
+                if (t->c->x >= g->col) {
+                        g->wrap[ROW(g, t->c->y)] = true;
+                        wrapped = CELL_WRAP;
+                        t->c->x = 0;
+                        t->c->y++;
+                }
+
+                if (t->c->y >= g->row) {
+                        t->c->y = g->row - 1;
+                        tscrollup(t, 0, 1, true);
+                }
+
+                int len = g->col - t->c->x;
+                if (len > n) len = n;
+
+                struct cell *line = g->line[ROW(g, t->c->y)] + t->c->x;
+                struct cell a = {
+                        .mode = t->c->mode,
+                        .fg = t->c->fg,
+                        .bg = t->c->bg,
+                };
+
+                for (int i = 0; i < len; i++) {
+                        a.c = (uint8_t)s[i];
+                        line[i] = a;
+                }
+
+                line[0].mode |= wrapped;
+                tdamage(t, t->c->y, t->c->x, t->c->x + len - 1);
+
+                t->c->x += len;
+                s += len;
+                n -= len;
+
+                if (t->c->x % g->col == 0)
+                        t->c->mode |= CELL_WRAPNEXT;
+        }
+}
+
 void tinsertblank(struct term *t, int n)
 {
         struct grid *g = t->g;
         int dst, src, size;
 
-        uint32_t *line;
-        struct cell_attr *attr;
+        struct cell *line;
 
         n = LIMIT(n, 0, g->col - t->c->x);
 
         dst = t->c->x + n;
         src = t->c->x;
         size = g->col - dst;
-        line = g->line[t->c->y];
-        attr = g->attr[t->c->y];
+        line = g->line[ROW(g, t->c->y)];
 
         memmove(line + dst, line + src, size * sizeof *line);
-        memmove(attr + dst, attr + src, size * sizeof *attr);
+        tdamage(t, t->c->y, dst, g->col - 1);
 
         tclearregion(t, src, t->c->y, dst - 1, t->c->y);
 }
@@ -444,10 +500,13 @@ void tclearregion(struct term *t, int x0, int y0, int x1, int y1)
         y1 = LIMIT(y1, 0, g->row - 1);
 
         for (int i = y0; i <= y1; i++) {
-                g->wrap[i] = false;
+                struct cell *line = g->line[ROW(g, i)];
+
+                g->wrap[ROW(g, i)] = false;
+                tdamage(t, i, x0, x1);
                 for (int j = x0; j <= x1; j++) {
-                        g->line[i][j] = 0;
-                        g->attr[i][j] = (struct cell_attr){
+                        line[j] = (struct cell){
+                                .c = 0,
                                 .mode = 0,
                                 .fg = -1,
                                 .bg = -1,
@@ -495,48 +554,86 @@ void tsetscroll(struct term *t, int top, int bot)
         g->bot = bot;
 }
 
-void tscrolldown(struct term *t, int orig, int n)
+/*
+ * Swaps rows `a` and `b` of the screen.
+ */
+static void tswaprows(struct term *t, int a, int b)
 {
         struct grid *g = t->g;
-        _printf("Scrolling %d lines around %d\n", n, orig);
 
-        tclearregion(t, 0, g->bot - n + 1, g->col - 1, g->bot);
+        tdamage(t, a, 0, g->col - 1);
+        tdamage(t, b, 0, g->col - 1);
+
+        a = ROW(g, a);
+        b = ROW(g, b);
 
-        for (int i = g->bot; i >= orig + n; i--) {
-                uint32_t *tmp = g->line[i];
-                g->line[i] = g->line[i - n];
-                g->line[i - n] = tmp;
+        struct cell *tmp = g->line[a];
+        g->line[a] = g->line[b];
+        g->line[b] = tmp;
+
+        bool temp = g->wrap[a];
+        g->wrap[a] = g->wrap[b];
+        g->wrap[b] = temp;
+}
 
-                struct cell_attr *tmp2 = g->attr[i];
-                g->attr[i] = g->attr[i - n];
-                g->attr[i - n] = tmp2;
+void tscrolldown(struct term *t, int orig, int n)
+{
+        struct grid *g = t->g;
+        _printf("Scrolling %d lines around %d\n", n, orig);
 
-                bool temp = g->wrap[i];
-                g->wrap[i] = g->wrap[i - n];
-                g->wrap[i - n] = temp;
+        /*
+         * When the whole screen scrolls, the bottom rows can become
+         * the top ones by moving the start of the ring back.
+         */
+        if (orig == 0 && g->bot == g->row - 1 && n > 0) {
+                n = LIMIT(n, 0, g->row);
+                g->head = (g->head + g->row - n) % g->row;
+                g->scrolled -= n;
+                tclearregion(t, 0, 0, g->col - 1, n - 1);
+                return;
         }
+
+        tclearregion(t, 0, g->bot - n + 1, g->col - 1, g->bot);
+
+        for (int i = g->bot; i >= orig + n; i--)
+                tswaprows(t, i, i - n);
 }
 
-void tscrollup(struct term *t, int orig, int n)
+/*
+ * Moves the lines from `orig` down to the bottom of the scroll region
+ * up by `n`. With `keep`, the lines going off the top of the primary
+ * screen are scrolling away and go into the scrollback; lines which
+ * are deleted don't.
+ */
+void tscrollup(struct term *t, int orig, int n, bool keep)
 {
         struct grid *g = t->g;
         _printf("Scrolling %d lines around %d\n", n, orig);
 
-        tclearregion(t, 0, orig, g->col - 1, orig + n - 1);
+        if (keep && orig == 0 && t->g == t->grid && n > 0) {
+                int m = n < g->bot + 1 ? n : g->bot + 1;
 
-        for (int i = orig; i <= g->bot - n; i++) {
-                uint32_t *tmp = g->line[i];
-                g->line[i] = g->line[i + n];
-                g->line[i + n] = tmp;
+                for (int i = 0; i < m; i++)
+                        scrollback_push(&t->scrollback, g->line[ROW(g, i)],
+                                        g->col, g->wrap[ROW(g, i)]);
 
-                struct cell_attr *tmp2 = g->attr[i];
-                g->attr[i] = g->attr[i + n];
-                g->attr[i + n] = tmp2;
+                /* Keep the view where it is if it's scrolled back. */
+                if (t->scroll) term_scroll(t, m);
+        }
 
-                bool temp = g->wrap[i];
-                g->wrap[i] = g->wrap[i + n];
-                g->wrap[i + n] = temp;
+        /* Likewise, the top rows become the bottom ones. */
+        if (orig == 0 && g->bot == g->row - 1 && n > 0) {
+                n = LIMIT(n, 0, g->row);
+                g->head = (g->head + n) % g->row;
+                g->scrolled += n;
+                tclearregion(t, 0, g->row - n, g->col - 1, g->row - 1);
+                return;
         }
+
+        tclearregion(t, 0, orig, g->col - 1, orig + n - 1);
+
+        for (int i = orig; i <= g->bot - n; i++)
+                tswaprows(t, i, i + n);
 }
 
 void tnewline(struct term *t, int first_col)
@@ -547,7 +644,7 @@ void tnewline(struct term *t, int first_col)
         int y = t->c->y;
 
         if (y == g->bot) {
-                tscrollup(t, g->top, 1);
+                tscrollup(t, g->top, 1, true);
         } else {
                 y++;
         }
@@ -598,7 +695,6 @@ void tstrhandle(struct term *t)
 
         t->stresc.len = 0;
         t->stresc.type = 0;
-        t->esc &= ~(ESC_STR | ESC_STR_END);
 }
 
 void tcontrolcode(struct term *t, uint32_t c)
@@ -606,10 +702,6 @@ void tcontrolcode(struct term *t, uint32_t c)
         _printf("\e[35m\\x%"PRIx32"\e[39m\n", c);
 
         switch (c) {
-        case ESC:
-                t->esc &= ~(ESC_CSI | ESC_ALTCHARSET);
-                t->esc |= ESC_START;
-                break;
         case LF:
         case VT:
                 /* Should the mode be in the grid? */
@@ -624,8 +716,6 @@ void tcontrolcode(struct term *t, uint32_t c)
                 break;
         case BEL:
                 /* The bell sound is annoying anyway. */
-                if (t->esc & ESC_STR_END)
-                        tstrhandle(t);
                 break;
         case BS:
                 tmoveto(t, t->c->x - 1, t->c->y);
@@ -638,82 +728,94 @@ void tdeletechar(struct term *t, int n)
         struct grid *g = t->g;
         int dst, src, size;
 
-        uint32_t *line;
-        struct cell_attr *attr;
+        struct cell *line;
 
         n = LIMIT(n, 0, g->col - t->c->x);
 
         dst = t->c->x;
         src = t->c->x + n;
         size = g->col - src;
-        line = g->line[t->c->y];
-        attr = g->attr[t->c->y];
+        line = g->line[ROW(g, t->c->y)];
 
         memmove(&line[dst], &line[src], size * sizeof *line);
-        memmove(&attr[dst], &attr[src], size * sizeof *attr);
+        tdamage(t, t->c->y, dst, g->col - 1);
 
         tclearregion(t, g->col - n, t->c->y, g->col - 1, t->c->y);
 }
 
-/*
- * The xterm way of ending a string escape sequence is to use the bell
- * character.
- */
-#define IS_STRING_ESCAPE_SEQUENCE_TERMINATOR(c) \
-        (c == '\a' || c == 030 || c == 032 || c == 033 || ISCONTROLC1(c))
-
-#define IS_CSI_ESCAPE_SEQUENCE_TERMINATOR(c) \
-        (c >= 0x40 && c <= 0x7E)
-
 /*
  * This function is important; all input goes through it. Any change
  * to the state of the terminal comes from this function interpreting
  * a code point. If you think of the terminal emulator like a game
  * console emulator then a code point is an opcode and this function
  * executes opcodes.
+ *
+ * What a code point means depends on the parser state, and
+ * `esc_table` says what to do with it and which state comes next.
+ * Entering and leaving a state can have actions of its own.
  */
 void tputc(struct term *t, uint32_t c)
 {
-        if (IS_STRING_ESCAPE_SEQUENCE_TERMINATOR(c)) {
-                t->esc &= ~(ESC_START | ESC_STR);
-                t->esc |= ESC_STR_END;
-        }
-
-        if (t->esc & ESC_STR) {
-                t->stresc.buf[t->stresc.len++] = c;
-                return;
+        uint8_t e = esc_table[t->esc][c < 0xa0 ? c : 0xa0];
+        enum esc_state next = ESC_NEXT(e);
+
+        if (next) {
+                switch (t->esc) {
+                case ESC_OSC_STRING:
+                case ESC_SOS_STRING:
+                case ESC_DCS_PASSTHROUGH:
+                        tstrhandle(t);
+                        break;
+                default:
+                        break;
+                }
         }
 
-        if (ISCONTROL(c)) {
+        switch (ESC_ACTION(e)) {
+        case ACT_PRINT:
+                tprintc(t, c);
+                break;
+        case ACT_EXECUTE:
                 tcontrolcode(t, c);
-                return;
+                break;
+        case ACT_COLLECT:
+                csicollect(&t->csi, c);
+                break;
+        case ACT_PARAM:
+                csiparam(&t->csi, c);
+                break;
+        case ACT_ESC_DISPATCH:
+                teschandle(t, c);
+                break;
+        case ACT_CSI_DISPATCH:
+                t->csi.mode = c;
+                tcsihandle(t, &t->csi);
+                break;
+        case ACT_PUT:
+                strescput(&t->stresc, c);
+                break;
         }
 
-        if (t->esc & ESC_START) {
-                if (t->esc & ESC_CSI) {
-                        t->csi.buf[t->csi.len++] = c;
-
-                        if (IS_CSI_ESCAPE_SEQUENCE_TERMINATOR(c)
-                            || t->csi.len >= sizeof(t->csi.buf)) {
-                                t->esc = 0;
-                                /*
-                                 * So now we have an entire escape sequence in
-                                 * `g->esc_buf`, just parse it and execute it.
-                                 */
-                                csiparse(&t->csi);
-                                tcsihandle(t, &t->csi);
-                        }
+        if (!next) return;
 
-                        return;
-                } else if (t->esc & ESC_ALTCHARSET) {
-                        _printf("TODO: Handle alternate charsets\n");
-                } else if (teschandle(t, c))
-                        t->esc = 0;
+        t->esc = next;
 
-                return;
+        switch (next) {
+        case ESC_ESCAPE:
+        case ESC_CSI_ENTRY:
+        case ESC_DCS_ENTRY:
+                csiclear(&t->csi);
+                break;
+        case ESC_OSC_STRING:
+        case ESC_SOS_STRING:
+                tstrsequence(t, c);
+                break;
+        case ESC_DCS_PASSTHROUGH:
+                tstrsequence(t, 0x90);
+                break;
+        default:
+                break;
         }
-
-        tprintc(t, c);
 }
 
 void thandlegraphicmode(struct term *t, long arg)
@@ -793,61 +895,168 @@ void tswapscreen(struct term *t)
         if (col != t->g->col || row != t->g->row)
                 tresize(t, col, row);
 
+        /* Don't swap to a screen which couldn't be made the same size. */
+        if (col != t->g->col || row != t->g->row) {
+                t->g = t->g == t->grid ? t->grid + 1 : t->grid;
+                return;
+        }
+
+        t->g->reset = t->frame;
+
         t->mode ^= MODE_ALTSCREEN;
 }
 
-#define TRUECOLOR(r,g,b) ((\
-                (((r) & 0xFF) << 16) |\
-                (((g) & 0xFF) << 8) |\
-                (((b) & 0xFF) << 0)) + 256\
-                )
+#define MARK(used, color) \
+        do { if ((color) >= 256) used[((color) - 256) / 64] |= 1ULL << ((color) - 256) % 64; } while (0)
 
-void tsetattr(struct term *t)
+/*
+ * Frees the truecolors which nothing refers to anymore: no cell on
+ * either screen, neither cursor and nothing in the scrollback's
+ * pending line. The rest of the scrollback keeps its colors as they
+ * are, so they aren't needed for it.
+ */
+static void tcollect(struct term *t)
 {
-        if (!t->csi.narg) {
-                thandlegraphicmode(t, 0);
-                return;
+        struct palette *p = &t->truecolor;
+        uint64_t used[TRUECOLOR_MAX / 64] = { 0 };
+
+        for (int k = 0; k < 2; k++) {
+                struct grid *g = t->grid + k;
+
+                MARK(used, t->c[k].fg);
+                MARK(used, t->c[k].bg);
+
+                if (!g->line) continue;
+
+                for (int i = 0; i < g->row; i++)
+                        for (int j = 0; j < g->col; j++) {
+                                MARK(used, g->line[i][j].fg);
+                                MARK(used, g->line[i][j].bg);
+                        }
         }
 
-        for (int i = 0; i < t->csi.narg; i++) {
-                if (t->csi.narg - i >= 5 && t->csi.arg[i] == 38 && t->csi.arg[i + 1] == 2) {
-                        /* This is a truecolor fg sequence. */
-                        t->c->fg = TRUECOLOR(t->csi.arg[i + 2], t->csi.arg[i + 3], t->csi.arg[i + 4]);
-                        i += 4;
-                        return;
-                }
+        for (int i = 0; i < t->scrollback.npending; i++) {
+                MARK(used, t->scrollback.pending[i].fg);
+                MARK(used, t->scrollback.pending[i].bg);
+        }
 
-                if (t->csi.narg - i >= 5 && t->csi.arg[i] == 48 && t->csi.arg[i + 1] == 2) {
-                        /* This is a truecolor bg sequence. */
-                        t->c->bg = TRUECOLOR(t->csi.arg[i + 2], t->csi.arg[i + 3], t->csi.arg[i + 4]);
-                        i += 4;
-                        return;
-                }
+        /* Put the colors which are still used back into a clean table. */
+        unsigned mask = 2 * TRUECOLOR_MAX - 1;
+
+        memset(p->hash, -1, 2 * TRUECOLOR_MAX * sizeof *p->hash);
+        p->nfree = 0;
 
-                if (t->csi.narg - i >= 3 && t->csi.arg[i] == 38 && t->csi.arg[i + 1] == 5) {
-                        /* This is a 256 fg sequence. */
-                        t->c->fg = t->csi.arg[i + 2];
-                        i += 2;
-                        return;
+        for (int i = p->n - 1; i >= 0; i--) {
+                if (!(used[i / 64] >> i % 64 & 1)) {
+                        p->free[p->nfree++] = i;
+                        continue;
                 }
 
-                if (t->csi.narg - i >= 3 && t->csi.arg[i] == 48 && t->csi.arg[i + 1] == 5) {
-                        /* This is a 256 bg sequence. */
-                        t->c->bg = t->csi.arg[i + 2];
-                        i += 2;
-                        return;
+                unsigned h = (p->rgb[i] * 2654435761u) >> 16 & mask;
+                while (p->hash[h] >= 0) h = (h + 1) & mask;
+                p->hash[h] = i;
+        }
+}
+
+#undef MARK
+
+/*
+ * Returns the color for `r`, `g`, `b`, adding it to the table of
+ * truecolors if it isn't there yet. Once the table is full the colors
+ * nothing uses anymore are collected, but if that frees up too little
+ * the next few colors go to the 256-color palette instead, so that a
+ * screen full of colors isn't scanned for every new one.
+ */
+static int ttruecolor(struct term *t, int r, int g, int b)
+{
+        struct palette *p = &t->truecolor;
+        uint32_t rgb = (r & 0xff) << 16 | (g & 0xff) << 8 | (b & 0xff);
+        int color = palette_find(p, rgb);
+
+        if (color < 0 && p->rgb) {
+                if (p->wait) {
+                        p->wait--;
+                } else {
+                        tcollect(t);
+                        if (p->nfree < TRUECOLOR_MAX / 16) p->wait = TRUECOLOR_MAX / 16;
+                        color = palette_find(p, rgb);
                 }
+        }
 
-                thandlegraphicmode(t, t->csi.arg[i]);
+        return color >= 0 ? color : palette_cube(rgb);
+}
+
+/*
+ * Parse the color after a 38 or 48 at `t->csi.arg[i]`, which is
+ * either `5;n` or `2;r;g;b`, or the same with colons. The colon form
+ * may also have a color space ID before r, g and b. Returns how many
+ * arguments were used.
+ */
+static int tsetcolor(struct term *t, int i, int nsub, int *color)
+{
+        const long *arg = t->csi.arg + i + 1;
+        int n = nsub ? nsub : t->csi.narg - i - 1;
+
+        if (n >= 2 && arg[0] == 5) {
+                if (arg[1] < 256) *color = arg[1];
+                return nsub ? nsub : 2;
+        }
+
+        if (n >= 4 && arg[0] == 2) {
+                if (nsub >= 5) arg++;
+                *color = ttruecolor(t, arg[1], arg[2], arg[3]);
+                return nsub ? nsub : 4;
         }
+
+        return nsub;
 }
 
-void tstrsequence(struct term *t, unsigned char c)
+void tsetattr(struct term *t)
+{
+        if (!t->csi.narg) {
+                thandlegraphicmode(t, 0);
+                return;
+        }
+
+        for (int i = 0; i < t->csi.narg; i++) {
+                /* How many sub-parameters follow this argument. */
+                int nsub = 0;
+                while (i + nsub + 1 < t->csi.narg && t->csi.sub[i + nsub + 1])
+                        nsub++;
+
+                switch (t->csi.arg[i]) {
+                case 38:
+                        i += tsetcolor(t, i, nsub, &t->c->fg);
+                        break;
+                case 48:
+                        i += tsetcolor(t, i, nsub, &t->c->bg);
+                        break;
+                case 4: /* 4:0 is no underline, 4:n is some kind of underline */
+                        thandlegraphicmode(t, nsub && !t->csi.arg[i + 1] ? 24 : 4);
+                        i += nsub;
+                        break;
+                default:
+                        thandlegraphicmode(t, t->csi.arg[i]);
+                        i += nsub;
+                        break;
+                }
+        }
+}
+
+/*
+ * Start collecting a string for `tstrhandle`. `c` is the character
+ * which introduced it, either the 8-bit C1 control or the second
+ * character of its 7-bit escape sequence.
+ */
+void tstrsequence(struct term *t, uint32_t c)
 {
         switch (c) {
         case 0x90:              /* DCS - Device control string */
                 c = 'P';
                 break;
+        case 0x98:              /* SOS - Start of string */
+                c = 'X';
+                break;
         case 0x9f:             /* APC - Application program command */
                 c = '_';
                 break;
@@ -860,17 +1069,91 @@ void tstrsequence(struct term *t, unsigned char c)
         }
 
         t->stresc.type = c;
-        t->esc |= ESC_STR;
+        t->stresc.len = 0;
 }
 
-int twrite(struct term *t, const char *buf, int buflen)
+/*
+ * Finishes the character left over from the last call to `twrite`
+ * with the continuation bytes at the start of `buf`. Returns how many
+ * bytes of `buf` were used.
+ */
+static int tputpartial(struct term *t, const char *buf, int buflen)
 {
-        int charsize, n;
+        unsigned len = 0;
+        uint32_t c;
+        int n = 0;
 
-        for (n = 0; n < buflen; n += charsize) {
-                uint32_t c;
-                if (!(charsize = utf8decode(buf + n, buflen - n, &c))) break;
+        while (!len && n < buflen && t->npartial < 4 && UTF8CONT(buf[n])) {
+                t->partial[t->npartial++] = buf[n++];
+                len = utf8decode(t->partial, t->npartial, &c);
+        }
+
+        /* Still not enough of it to tell. */
+        if (!len && n == buflen) return n;
+
+        if (!len) {
+                tputc(t, UTF8_REPLACEMENT);
+        } else {
                 tputc(t, c);
+
+                /* The character was broken and these are strays. */
+                for (int i = len; i < t->npartial; i++)
+                        tputc(t, UTF8_REPLACEMENT);
+        }
+
+        t->npartial = 0;
+
+        return n;
+}
+
+int twrite(struct term *t, const char *buf, int buflen)
+{
+        int n = 0;
+
+        if (t->npartial) n = tputpartial(t, buf, buflen);
+
+        while (n < buflen) {
+                /*
+                 * Most of what comes through here is plain text.
+                 * Outside of an escape sequence, a run of printable
+                 * ASCII can go straight into the grid.
+                 */
+                if (t->esc == ESC_GROUND && ISPRINTASCII(buf[n])) {
+                        int len = asciirun(buf + n, buflen - n);
+                        tprintascii(t, buf + n, len);
+                        n += len;
+                        continue;
+                }
+
+                if ((uint8_t)buf[n] < 0x80) {
+                        tputc(t, buf[n++]);
+                        continue;
+                }
+
+                /*
+                 * Decode the whole run of multibyte characters in
+                 * one go. A character cut off by the end of the
+                 * buffer is saved for next time; one cut off by
+                 * anything else is just broken.
+                 */
+                int end = n + 1;
+                while (end < buflen && (uint8_t)buf[end] >= 0x80) end++;
+
+                uint32_t c[1024];
+                size_t used, k;
+
+                do {
+                        k = utf8transcode(buf + n, end - n, c, sizeof c / sizeof *c,
+                                          end == buflen, &used);
+                        for (size_t i = 0; i < k; i++) tputc(t, c[i]);
+                        n += used;
+                } while (k && n < end);
+
+                if (n < end) {
+                        t->npartial = end - n;
+                        memcpy(t->partial, buf + n, t->npartial);
+                        n = end;
+                }
         }
 
         return n;
@@ -909,6 +1192,9 @@ void handle_terminal_mode(struct term *t, int set, bool priv)
                 case 25: /* Make cursor visible */
                         mode |= MODE_CURSOR_VISIBLE;
                         break;
+                case 2004: /* Bracketed paste */
+                        mode |= MODE_BRACKETED_PASTE;
+                        break;
                 }
         }
 
@@ -922,7 +1208,17 @@ void tcsihandle(struct term *t, struct csi *csi)
 {
         struct grid *g = t->g;
 
-        switch (*csi->mode) {
+        _printf("CSI %c%c%c with %d args\n", csi->priv ? csi->priv : ' ',
+                csi->inter ? csi->inter : ' ', csi->mode, csi->narg);
+
+        /*
+         * The only private marker anything here knows about is `?`,
+         * and the only intermediate is the space in DECSCUSR.
+         */
+        if (csi->priv && csi->priv != '?') goto unhandled;
+        if (csi->ninter > 1 || (csi->inter && csi->mode != 'q')) goto unhandled;
+
+        switch (csi->mode) {
         case '@': /* ICH -- Insert <n> blank char */
                 tinsertblank(t, csi->narg ? csi->arg[0] : 1);
                 break;
@@ -942,7 +1238,7 @@ void tcsihandle(struct term *t, struct csi *csi)
                 tmoveto(t, t->c->x - CSIDEFAULT(csi->arg[0], 1), t->c->y);
                 break;
         case 'h': /* Set terminal mode */
-                handle_terminal_mode(t, 1, csi->priv);
+                handle_terminal_mode(t, 1, csi->priv == '?');
                 break;
         case 'H': /* CUP - Move cursor too coordinates */
                 if (!csi->narg)
@@ -980,7 +1276,7 @@ void tcsihandle(struct term *t, struct csi *csi)
                         tclearregion(t, 0, t->c->y, g->col - 1, t->c->y);
                 break;
         case 'l': /* Reset terminal mode */
-                handle_terminal_mode(t, 0, csi->priv);
+                handle_terminal_mode(t, 0, csi->priv == '?');
                 break;
         case 'L': /* IL - Insert n blank lines */
                 tscrolldown(t, t->c->y, csi->narg ? csi->arg[0] : 1);
@@ -989,17 +1285,17 @@ void tcsihandle(struct term *t, struct csi *csi)
                 tsetattr(t);
                 break;
         case 'M': /* DL - Delete n lines */
-                tscrollup(t, t->c->y, csi->narg ? csi->arg[0] : 1);
+                tscrollup(t, t->c->y, csi->narg ? csi->arg[0] : 1, false);
                 break;
         case 'P': /* DCH - Delete n chars */
                 tdeletechar(t, csi->narg ? csi->arg[0] : 1);
                 break;
 	case 'S': /* SU - Scroll n line up */
-		tscrollup(t, g->top, csi->narg ? csi->arg[0] : 1);
+		tscrollup(t, g->top, csi->narg ? csi->arg[0] : 1, true);
 		break;
 	case 's': /* DECSC - Save cursor position */
 	case 'u': /* DECRC - Restore cursor position */
-		tcursor(t, *csi->mode == 's');
+		tcursor(t, csi->mode == 's');
 		break;
 	case 'T': /* SD - Scroll n line down */
 		tscrolldown(t, g->top, csi->narg ? csi->arg[0] : 1);
@@ -1020,13 +1316,11 @@ void tcsihandle(struct term *t, struct csi *csi)
                 tclearregion(t, t->c->x, t->c->y,
                              t->c->x + (csi->narg ? csi->arg[0] : 1), t->c->y);
                 break;
-        case ' ':
-                if (csi->arg[0] < 0 || csi->arg[0] > CURSOR_STYLE_MAX)
+        case 'q': /* DECSCUSR - Set cursor style */
+                if (csi->inter != ' ' || csi->arg[0] < 0 || csi->arg[0] > CURSOR_STYLE_MAX)
                         goto unhandled;
-                if (csi->mode[1] == 'q') {
-                        t->c->style = csi->arg[0];
-                        break;
-                }
+                t->c->style = csi->arg[0];
+                break;
         default:
                 goto unhandled;
         }
@@ -1036,41 +1330,44 @@ unhandled:
         _printf(" ^ \e[33mUnhandled CSI\e[0m\n");
 }
 
-int teschandle(struct term *t, uint32_t c)
+/*
+ * Execute an escape sequence which isn't a CSI or a string. Its
+ * intermediate, if it had one, was collected into `t->csi`.
+ */
+void teschandle(struct term *t, uint32_t c)
 {
         struct grid *g = t->g;
+
+        if (t->csi.ninter > 1) goto unhandled;
+
+        switch (t->csi.inter) {
+        case '(': /* GZD4 - Set primary charset G0 */
+        case ')': /* G1D4 - Set secondary charset G1 */
+        case '*': /* G2D4 - Set tertiary charset G2 */
+        case '+': /* G3D4 - Set quaternary charset G3 */
+                /* TODO: Handle alternate charsets (the charset is `c`). */
+                g->charset = t->csi.inter - '(';
+                return;
+        case 0:
+                break;
+        default:
+                goto unhandled;
+        }
+
         switch (c) {
-        case '[':
-                t->esc |= ESC_CSI;
-                return 0;
-        case 'P': /* DCS - Device Control String */
-        case '_': /* APC - Application Program Command */
-        case '^': /* PM - Privacy Message */
-        case ']': /* OSC - Operating System Command */
-        case 'k': /* I think this is an xterm thing */
-                tstrsequence(t, c);
-                return 0;
         case 'M': /* RI - Reverse index */
                 if (t->c->y == g->top) {
                         tscrolldown(t, g->top, 1);
                 } else {
                         tmoveto(t, t->c->x, t->c->y - 1);
                 }
-                return 1;
-        case '(': /* GZD4 - Set primary charset G0 */
-        case ')': /* G1D4 - Set secondary charset G1 */
-        case '*': /* G2D4 - Set tertiary charset G2 */
-        case '+': /* G3D4 - Set quaternary charset G3 */
-                g->charset = c - '(';
-                t->esc |= ESC_ALTCHARSET;
-                return 0;
+                return;
         case '\\': /* ST - String terminator */
-                if (t->esc & ESC_STR_END)
-                        tstrhandle(t);
-                break;
-        default:
-                _printf("\e[31mUnhandled escape %c\e[0m\n", (unsigned char)c);
+                /* The string was handled on the way out of its state. */
+                return;
         }
 
-        return 1;
+unhandled:
+        _printf("\e[31mUnhandled escape %c%c\e[0m\n",
+                t->csi.inter ? t->csi.inter : ' ', (unsigned char)c);
 }
@@ -5,12 +5,133 @@ void term_init(struct term *t)
 {
         memset(t, 0, sizeof *t);
         t->mode = MODE_CURSOR_VISIBLE;
+        t->esc = ESC_GROUND;
         t->c[0].fg = t->c[0].bg = -1;
         t->c[1].fg = t->c[1].bg = -1;
         t->g = t->grid;
+        t->frame = 1;
+        scrollback_init(&t->scrollback, &t->truecolor);
+}
+
+/* Frees everything `t` holds, but not `t` itself. */
+void term_free(struct term *t)
+{
+        for (int i = 0; i < 2; i++) {
+                free(t->grid[i].damage);
+                free(t->grid[i].spare);
+        }
+
+        free(t->truecolor.rgb);
+        free(t->truecolor.hash);
+        free(t->truecolor.free);
+        scrollback_free(&t->scrollback);
 }
 
 void term_resize(struct term *t, int col, int row)
 {
         tresize(t, col, row);
 }
+
+/*
+ * Scroll the view `n` lines back through the scrollback, or forward
+ * if `n` is negative.
+ */
+void term_scroll(struct term *t, int n)
+{
+        long scroll = (long)t->scroll + n;
+        int old = t->scroll;
+
+        t->scroll = scrollback_rows(&t->scrollback, t->g->col, scroll < 0 ? 0 : scroll);
+
+        /* Every row of the view shows something else now. */
+        if (t->scroll != old) t->g->reset = t->frame;
+}
+
+/*
+ * Changes to the grid are stamped with the number of the frame they
+ * were made in. This ends that frame and returns its number, which
+ * can later be given to `term_damage` to find out what has changed
+ * since.
+ */
+unsigned long term_frame(struct term *t)
+{
+        return t->frame++;
+}
+
+/*
+ * Whether row `i` of `line` has changed since frame `since`, and if so
+ * which columns, from `x0` to `x1`. Use `ROW` to ask about a row of
+ * the screen. Scrolling the whole screen only moves `head`, so rows
+ * which were only moved aren't reported; `scrolled` says by how much.
+ *
+ * The columns are only known exactly for changes made in the frame
+ * right after `since`. Otherwise the whole row is reported.
+ */
+bool term_damage(struct term *t, int i, unsigned long since, int *x0, int *x1)
+{
+        struct grid *g = t->g;
+        struct damage *d = g->damage + i;
+
+        if (g->reset <= since && d->frame <= since)
+                return false;
+
+        if (g->reset <= since && d->frame == since + 1) {
+                *x0 = d->x0;
+                *x1 = d->x1;
+        } else {
+                *x0 = 0;
+                *x1 = g->col - 1;
+        }
+
+        return true;
+}
+
+/*
+ * The color for `rgb` in the table of truecolors, added to it if it
+ * isn't there yet. Returns -1 if it isn't there and there's no room.
+ */
+int palette_find(struct palette *p, uint32_t rgb)
+{
+        if (!p->rgb) {
+                p->rgb = malloc(TRUECOLOR_MAX * sizeof *p->rgb);
+                p->hash = malloc(2 * TRUECOLOR_MAX * sizeof *p->hash);
+                p->free = malloc(TRUECOLOR_MAX * sizeof *p->free);
+                if (!p->rgb || !p->hash || !p->free) {
+                        free(p->rgb), free(p->hash), free(p->free);
+                        p->rgb = NULL, p->hash = NULL, p->free = NULL;
+                        return -1;
+                }
+
+                memset(p->hash, -1, 2 * TRUECOLOR_MAX * sizeof *p->hash);
+        }
+
+        /* The table is half full at most, so this always finds a hole. */
+        unsigned mask = 2 * TRUECOLOR_MAX - 1;
+        unsigned h = (rgb * 2654435761u) >> 16 & mask;
+
+        for (; p->hash[h] >= 0; h = (h + 1) & mask)
+                if (p->rgb[p->hash[h]] == rgb)
+                        return 256 + p->hash[h];
+
+        int i;
+
+        if (p->nfree) i = p->free[--p->nfree];
+        else if (p->n < TRUECOLOR_MAX) i = p->n++;
+        else return -1;
+
+        p->rgb[i] = rgb;
+        p->hash[h] = i;
+
+        return 256 + i;
+}
+
+/*
+ * The closest color to `rgb` in the 6x6x6 cube of the 256-color
+ * palette, whose levels are 0, 95, 135, 175, 215 and 255.
+ */
+int palette_cube(uint32_t rgb)
+{
+#define CUBE(x) ((x) < 48 ? 0 : (x) < 115 ? 1 : ((x) - 35) / 40)
+        return 16 + 36 * CUBE(rgb >> 16 & 0xff) + 6 * CUBE(rgb >> 8 & 0xff) + CUBE(rgb & 0xff);
+#undef CUBE
+}
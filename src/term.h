@@ -8,6 +8,7 @@
 #include "util.h"
 #include "sprite.h"
 #include "esc.h"
+#include "scrollback.h"
 
 struct cursor {
         int x, y, mode, state;
@@ -31,15 +32,57 @@ enum {
         MODE_APPCURSOR      = 1 << 2,
         MODE_WRAP           = 1 << 3, /* Whether to wrap lines or truncate */
         MODE_ALTSCREEN      = 1 << 4,
+        MODE_BRACKETED_PASTE = 1 << 5,
+};
+
+/*
+ * A color is -1 for the default, 0-255 for the palette, and from 256
+ * up an index into the term's table of truecolors.
+ */
+struct cell {
+        uint32_t c : 21;        /* The code point */
+        uint32_t mode : 11;     /* CELL_* */
+        int16_t fg, bg;
+};
+
+_Static_assert(sizeof(struct cell) == 8, "cells should be packed");
+
+/* What has changed in a row, and when. See `term_damage`. */
+struct damage {
+        unsigned long frame;    /* The last frame it changed in */
+        int x0, x1;             /* The columns that changed in that frame */
 };
 
 struct term {
         struct cursor c[2];
 
         struct grid {
-                uint32_t **line;
-                struct cell_attr { int mode, fg, bg; } **attr;
+                /*
+                 * The rows are a ring which starts at `head`, so that
+                 * scrolling the whole screen only has to move `head`.
+                 * Use `ROW` to find where a row on the screen is.
+                 */
+                struct cell **line;
                 bool *wrap;
+                int head;
+
+                /*
+                 * What has changed in each row of `line`, the last
+                 * frame everything changed in, and how many rows
+                 * `head` has been moved forward by all told.
+                 */
+                struct damage *damage;
+                unsigned long reset;
+                long scrolled;
+
+                /*
+                 * `line`, `wrap` and `damage` share one block of
+                 * `size` bytes. The block from before the last resize
+                 * is kept as `spare` to build the next one in.
+                 */
+                size_t size;
+                void *spare;
+                size_t sparesize;
 
                 int row, col;
                 int top, bot;
@@ -55,17 +98,34 @@ struct term {
                 int charset;
         } grid[2];
 
-        enum {
-                ESC_START      = 1 << 0, /* Always set during parsing */
-                ESC_CSI        = 1 << 1, /* Always set during CSI parsing */
-                ESC_ALTCHARSET = 1 << 2, /* Always set during ... parsing */
-                ESC_STR        = 1 << 3, /* Always set during ... parsing */
-                ESC_STR_END    = 1 << 4, /* Set after string termination */
-        } esc;
+        enum esc_state esc;     /* The state of the parser */
 
         struct csi csi;
         struct stresc stresc;
 
+        /*
+         * The start of a multibyte character which was cut off at the
+         * end of the last chunk of input.
+         */
+        char partial[4];
+        int npartial;
+
+        /*
+         * The truecolors cells on the screen refer to, so that a cell
+         * can refer to one with 16 bits. `hash` maps colors to their
+         * indices with open addressing; -1 is an empty slot. Colors
+         * which nothing refers to anymore are collected once the
+         * table fills up and their slots go on the `free` stack. The
+         * scrollback keeps its colors as they are, not as indices.
+         */
+        struct palette {
+                uint32_t *rgb;
+                int16_t *hash;
+                int16_t *free;
+                int n, nfree;
+                int wait;       /* Colors to go without collecting for */
+        } truecolor;
+
         /*
          * There are two grids: the primary grid and the alternate
          * grid. All operations happen on the primary grid, which this
@@ -73,9 +133,29 @@ struct term {
          */
         struct grid *g;
 
+        /*
+         * Lines which have scrolled off the primary screen, and how
+         * many of them the view is scrolled back by.
+         */
+        struct scrollback scrollback;
+        int scroll;
+
         int mode;
+
+        /* The frame changes are being made in. See `term_frame`. */
+        unsigned long frame;
 };
 
+/* The index in `line` and `wrap` of row `y` of the screen. */
+#define ROW(g, y) ((y) + (g)->head < (g)->row ? (y) + (g)->head : (y) + (g)->head - (g)->row)
+
 void term_init(struct term *t);
+void term_free(struct term *t);
 void term_title(struct term *f, const char *title);
 void term_resize(struct term *t, int col, int row);
+void term_scroll(struct term *t, int n);
+unsigned long term_frame(struct term *t);
+bool term_damage(struct term *t, int i, unsigned long since, int *x0, int *x1);
+
+int palette_find(struct palette *p, uint32_t rgb);
+int palette_cube(uint32_t rgb);
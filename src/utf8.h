@@ -1,26 +1,257 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #define UTF8CONT(X) (((uint8_t)(X) & 0xc0) == 0x80)
 
-static inline unsigned utf8chrlen(const char *s, unsigned l)
+#define UTF8_REPLACEMENT 0xfffd
+
+/*
+ * Decodes the character at the start of `s` and returns its length,
+ * or 0 if the input ends before the character does (so that the
+ * caller can wait for the rest of it).
+ *
+ * Malformed input (stray continuation bytes, overlong forms,
+ * surrogates, anything past U+10FFFF) decodes to U+FFFD. Following
+ * the Unicode recommendation, each maximal subpart of a broken
+ * sequence becomes one U+FFFD: 'E2 82 41' is U+FFFD followed by 'A'.
+ */
+static inline unsigned utf8decode(const char *s, size_t l, uint32_t *c)
+{
+        uint8_t b = s[0], lo = 0x80, hi = 0xbf;
+        unsigned len;
+
+        if (b < 0x80) {
+                *c = b;
+                return 1;
+        }
+
+        if (b >= 0xc2 && b <= 0xdf) {
+                len = 2, *c = b & 0x1f;
+        } else if (b >= 0xe0 && b <= 0xef) {
+                len = 3, *c = b & 0x0f;
+                if (b == 0xe0) lo = 0xa0;               /* Overlong */
+                if (b == 0xed) hi = 0x9f;               /* Surrogates */
+        } else if (b >= 0xf0 && b <= 0xf4) {
+                len = 4, *c = b & 0x07;
+                if (b == 0xf0) lo = 0x90;               /* Overlong */
+                if (b == 0xf4) hi = 0x8f;               /* Past U+10FFFF */
+        } else {
+                *c = UTF8_REPLACEMENT;
+                return 1;
+        }
+
+        for (unsigned i = 1; i < len; i++) {
+                if (i >= l) return 0;
+
+                uint8_t x = s[i];
+
+                if (x < lo || x > hi) {
+                        *c = UTF8_REPLACEMENT;
+                        return i;
+                }
+
+                *c = *c << 6 | (x & 0x3f);
+                lo = 0x80, hi = 0xbf;
+        }
+
+        return len;
+}
+
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+
+/*
+ * Keiser and Lemire's lookup algorithm, as used by simdjson and
+ * simdutf. Every byte is classified by three 16-entry tables (the high
+ * and low nibbles of the previous byte and the high nibble of this
+ * one); each bit is one kind of error and a byte is bad if all three
+ * agree on some bit. The only thing the tables can't see is the third
+ * and fourth bytes of long sequences, which are checked separately.
+ */
+static inline __m128i utf8errors(__m128i in, __m128i prev)
+{
+        enum {
+                TOO_SHORT = 1 << 0,     /* Lead byte, then no continuation */
+                TOO_LONG = 1 << 1,      /* ASCII, then a continuation */
+                OVERLONG_3 = 1 << 2,
+                TOO_LARGE = 1 << 3,
+                SURROGATE = 1 << 4,
+                OVERLONG_2 = 1 << 5,
+                TOO_LARGE_1000 = 1 << 6,
+                OVERLONG_4 = 1 << 6,
+                TWO_CONTS = 1 << 7,     /* Continuation, then another */
+                CARRY = TOO_SHORT | TOO_LONG | TWO_CONTS,
+        };
+
+        const __m128i byte1_high = _mm_setr_epi8(
+                TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+                TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+                TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+                TOO_SHORT | OVERLONG_2,
+                TOO_SHORT,
+                TOO_SHORT | OVERLONG_3 | SURROGATE,
+                TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4);
+        const __m128i byte1_low = _mm_setr_epi8(
+                CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+                CARRY | OVERLONG_2,
+                CARRY,
+                CARRY,
+                CARRY | TOO_LARGE,
+                CARRY | TOO_LARGE | TOO_LARGE_1000,
+                CARRY | TOO_LARGE | TOO_LARGE_1000,
+                CARRY | TOO_LARGE | TOO_LARGE_1000,
+                CARRY | TOO_LARGE | TOO_LARGE_1000,
+                CARRY | TOO_LARGE | TOO_LARGE_1000,
+                CARRY | TOO_LARGE | TOO_LARGE_1000,
+                CARRY | TOO_LARGE | TOO_LARGE_1000,
+                CARRY | TOO_LARGE | TOO_LARGE_1000,
+                CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+                CARRY | TOO_LARGE | TOO_LARGE_1000,
+                CARRY | TOO_LARGE | TOO_LARGE_1000);
+        const __m128i byte2_high = _mm_setr_epi8(
+                TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+                TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+                TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+                TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+                TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+                TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+                TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT);
+
+        const __m128i nibble = _mm_set1_epi8(0x0f);
+        __m128i prev1 = _mm_alignr_epi8(in, prev, 15);
+        __m128i prev2 = _mm_alignr_epi8(in, prev, 14);
+        __m128i prev3 = _mm_alignr_epi8(in, prev, 13);
+
+        __m128i special = _mm_and_si128(
+                _mm_and_si128(_mm_shuffle_epi8(byte1_high, _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+                              _mm_shuffle_epi8(byte1_low, _mm_and_si128(prev1, nibble))),
+                _mm_shuffle_epi8(byte2_high, _mm_and_si128(_mm_srli_epi16(in, 4), nibble)));
+
+        /* Bytes two and three after a lead byte of 0xe0 or 0xf0 and up. */
+        __m128i third = _mm_subs_epu8(prev2, _mm_set1_epi8((char)(0xe0 - 0x80)));
+        __m128i fourth = _mm_subs_epu8(prev3, _mm_set1_epi8((char)(0xf0 - 0x80)));
+        __m128i must23 = _mm_and_si128(_mm_or_si128(third, fourth), _mm_set1_epi8((char)0x80));
+
+        return _mm_xor_si128(must23, special);
+}
+#endif
+
+/*
+ * Returns the length of a prefix of `s` which is known to be valid
+ * UTF-8 and doesn't end in the middle of a character. This is only a
+ * fast check; it may stop well short of the first actual error.
+ */
+static inline size_t utf8valid(const char *s, size_t l)
 {
-        unsigned i = 0;
-        while (s++ && ++i < l && UTF8CONT(*s));
+        size_t i = 0;
+
+#if defined(__SSSE3__)
+        __m128i prev = _mm_setzero_si128();
+
+        for (; i + 16 <= l; i += 16) {
+                __m128i in = _mm_loadu_si128((const __m128i *)(s + i));
+                if (_mm_movemask_epi8(_mm_cmpeq_epi8(utf8errors(in, prev), _mm_setzero_si128())) != 0xffff)
+                        break;
+                prev = in;
+        }
+
+        /*
+         * A sequence's errors show up on its continuation bytes, so
+         * a character that runs past the last clean block hasn't been
+         * checked yet. Back off to its lead byte.
+         */
+        for (size_t j = 1; j <= 3 && j <= i; j++) {
+                uint8_t b = s[i - j];
+                if (b < 0x80) break;
+                if (b >= 0xc0) {
+                        i -= j;
+                        break;
+                }
+        }
+#else
+        (void)s, (void)l;
+#endif
+
         return i;
 }
 
-static inline unsigned utf8decode(const char *s, unsigned l, uint32_t *c)
+/*
+ * Decodes a sequence which has already been validated.
+ */
+static inline unsigned utf8decodevalid(const char *s, uint32_t *c)
 {
-        unsigned len = utf8chrlen(s, l);
+        uint8_t b = s[0];
 
-        *c = (*s & ((1 << (8 - len)) - 1))
-                << (len - 1) * 6;
-        for (unsigned i = 1; i < len; i++)
-                *c |= (s[i] & 0x3F) << (len - i - 1) * 6;
+        if (b < 0x80) {
+                *c = b;
+                return 1;
+        }
 
-        return len;
+        if (b < 0xe0) {
+                *c = (b & 0x1f) << 6 | (s[1] & 0x3f);
+                return 2;
+        }
+
+        if (b < 0xf0) {
+                *c = (b & 0x0f) << 12 | (s[1] & 0x3f) << 6 | (s[2] & 0x3f);
+                return 3;
+        }
+
+        *c = (b & 0x07) << 18 | (s[1] & 0x3f) << 12 | (s[2] & 0x3f) << 6 | (s[3] & 0x3f);
+        return 4;
+}
+
+/*
+ * Decodes up to `n` characters from `s` into `out` and returns how
+ * many there were, with the number of bytes they took in `*used`.
+ * Malformed input becomes U+FFFD as in `utf8decode`.
+ *
+ * If `partial` is set and the input ends partway through a character,
+ * decoding stops before it; otherwise the stub is malformed like any
+ * other and becomes U+FFFD.
+ *
+ * Runs which pass the vectorized check are decoded without checking
+ * each byte again; everything else goes through `utf8decode`.
+ */
+static inline size_t utf8transcode(const char *s, size_t l, uint32_t *out,
+                                   size_t n, bool partial, size_t *used)
+{
+        size_t i = 0, k = 0;
+
+        while (i < l && k < n) {
+                /* There's no sense in checking more than fits in `out`. */
+                size_t max = l - i < n - k ? l - i : n - k;
+                size_t valid = i + utf8valid(s + i, max);
+
+                while (i < valid)
+                        i += utf8decodevalid(s + i, out + k++);
+
+                /* A few characters the slow way, then try again. */
+                for (size_t end = i + 16; i < l && i < end && k < n; k++) {
+                        unsigned len = utf8decode(s + i, l - i, out + k);
+
+                        if (!len) {
+                                if (partial) goto done;
+                                out[k] = UTF8_REPLACEMENT;
+                                len = l - i;
+                        }
+
+                        i += len;
+                }
+        }
+
+done:
+        *used = i;
+        return k;
 }
 
 static inline int utf8encode(uint32_t c, uint8_t *buf, unsigned *len)
@@ -49,3 +280,54 @@ static inline int utf8encode(uint32_t c, uint8_t *buf, unsigned *len)
 
         return 0;
 }
+
+#define ISPRINTASCII(c) ((uint8_t)(c) >= 0x20 && (uint8_t)(c) < 0x7f)
+
+/*
+ * Returns the length of the run of printable ASCII at the start of
+ * `s`, i.e. how far it is to the first byte which is a control
+ * character, DEL, or part of a multibyte sequence.
+ */
+static inline size_t asciirun(const char *s, size_t l)
+{
+        size_t i = 0;
+
+        /*
+         * Bytes are compared as signed so that everything from 0x80
+         * up counts as negative and fails the first comparison along
+         * with the control characters.
+         */
+#if defined(__AVX2__)
+        for (; i + 32 <= l; i += 32) {
+                __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+                __m256i ok = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(0x1f)),
+                                              _mm256_cmpgt_epi8(_mm256_set1_epi8(0x7f), v));
+                uint32_t mask = ~(uint32_t)_mm256_movemask_epi8(ok);
+                if (mask) return i + __builtin_ctz(mask);
+        }
+#endif
+
+#if defined(__SSE2__)
+        for (; i + 16 <= l; i += 16) {
+                __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+                __m128i ok = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(0x1f)),
+                                           _mm_cmplt_epi8(v, _mm_set1_epi8(0x7f)));
+                unsigned mask = ~_mm_movemask_epi8(ok) & 0xffff;
+                if (mask) return i + __builtin_ctz(mask);
+        }
+#elif defined(__ARM_NEON)
+        for (; i + 16 <= l; i += 16) {
+                int8x16_t v = vld1q_s8((const int8_t *)(s + i));
+                uint8x16_t ok = vandq_u8(vcgtq_s8(v, vdupq_n_s8(0x1f)),
+                                         vcltq_s8(v, vdupq_n_s8(0x7f)));
+
+                /* vminvq_u8 would do, but armv7 doesn't have it. */
+                uint8x8_t all = vand_u8(vget_low_u8(ok), vget_high_u8(ok));
+                if (vget_lane_u64(vreinterpret_u64_u8(all), 0) != UINT64_MAX) break;
+        }
+#endif
+
+        while (i < l && ISPRINTASCII(s[i])) i++;
+
+        return i;
+}
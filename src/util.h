@@ -8,13 +8,97 @@
 /* TODO: This is one of the most concerning. */
 #define NUM_CELL 32000
 
+/* The size of the sprite lookup table, a power of two above NUM_CELL. */
+#define SPRITE_INDEX_SIZE 65536
+
 /* TODO: Make this dynamic. */
 #define MAX_SPRITES_IN_FONT 1000
 #define LINE_SPACING 4
 
+/*
+ * With persistently mapped buffers, how many frames' worth of cells
+ * can be on their way to the GPU before writing the next has to wait.
+ */
+#define RENDER_BUFFERS 3
+
 /* How long could an escape sequence possibly be. */
 #define ESC_ARG_SIZE 512
 
+/*
+ * How much the shell can say before the terminal has to catch up,
+ * and how much of that the terminal will chew through per frame.
+ * The ring size must be a power of two.
+ */
+#define PTY_RING_SIZE (1 << 22)
+#define PTY_DRAIN_BUDGET (1 << 20)
+
+/*
+ * The PTY reader starts out asking for `PTY_READ_MIN` bytes per read
+ * and doubles that up to `PTY_READ_MAX` while reads keep coming back
+ * full, which on Linux means as much as a PTY gives in one read.
+ * Everything read from one shell in one go is handed to the
+ * terminal as one chunk, and no shell gets more than
+ * `PTY_COALESCE_NS` of the I/O thread's time in one go.
+ */
+#define PTY_READ_MIN BUFSIZ
+#define PTY_READ_MAX (1 << 20)
+#define PTY_COALESCE_NS 1000000
+
+/*
+ * How much input can be on its way to a shell at once. Anything past
+ * this waits on the main thread until the shell catches up. Must be a
+ * power of two.
+ */
+#define PTY_WRITE_RING_SIZE (1 << 16)
+
+/* How far a paste is allowed to get ahead of the shell. */
+#define PASTE_WINDOW (1 << 18)
+
+/*
+ * How many distinct truecolors can be on a terminal's screens at once.
+ * Once the table is full the colors which have gone from the screens
+ * are collected, and a color which still doesn't fit gets the closest
+ * color from the 256-color palette instead. Must be a power of two.
+ */
+#define TRUECOLOR_MAX (1 << 13)
+
+/*
+ * Scrollback is kept in pages of `SCROLLBACK_PAGE` bytes. All but the
+ * newest `SCROLLBACK_HOT` pages are compressed, and once the pages
+ * take up more than `SCROLLBACK_BYTES` the oldest ones are dropped.
+ */
+#define SCROLLBACK_BYTES (64 << 20)
+#define SCROLLBACK_PAGE (1 << 16)
+#define SCROLLBACK_HOT 4
+
+/*
+ * With `SCROLLBACK_SPILL` the pages which don't fit in memory are
+ * written to temporary files in $TMPDIR (or /var/tmp) instead of being
+ * dropped, `SCROLLBACK_SEGMENT` bytes to a file, and only dropped once
+ * there's more than `SCROLLBACK_SPILL_BYTES` of them.
+ */
+#define SCROLLBACK_SPILL 0
+#define SCROLLBACK_SEGMENT (64 << 20)
+#define SCROLLBACK_SPILL_BYTES (16ULL << 30)
+
+/*
+ * Dragging the window edge resizes it many times a second. The grids
+ * are resized once a frame to whatever the last size was, but shells
+ * are only told the new size once it has stayed put for this many
+ * seconds, so they don't redraw at every size along the way.
+ */
+#define RESIZE_QUIET 0.1
+
+/*
+ * The loop sleeps until there's input, something from a shell or a
+ * resize, and then draws at most `MAX_FPS` frames a second. With
+ * `LATENCY_MODE` anything that happens within a frame of a key being
+ * pressed, like the shell echoing it, is drawn straight away instead
+ * of waiting for the next frame to come due.
+ */
+#define MAX_FPS 120
+#define LATENCY_MODE 1
+
 #define VT_IDENTITY "\033[?6c"
 
 struct color {
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * The number of cells a character takes up, the same on every system
+ * regardless of the libc or the locale. Returns -1 for control
+ * characters like `wcwidth` does.
+ *
+ * The tables are generated by tools/wcwidth.py; see there for how
+ * they're laid out.
+ */
+
+extern const uint8_t wcwidth_index[0x1100];
+extern const uint8_t wcwidth_blocks[][64];
+
+static inline int kty_wcwidth(uint32_t c)
+{
+        if (c >= 0x20 && c < 0x7f) return 1;
+        if (c > 0x10ffff) return 1;
+
+        const uint8_t *block = wcwidth_blocks[wcwidth_index[c >> 8]];
+
+        return (block[(c & 0xff) >> 2] >> (c & 3) * 2 & 3) - 1;
+}
@@ -3,6 +3,7 @@
 #include "t.h"
 #include "global.h"
 #include "platform.h"
+#include "paste.h"
 
 extern struct global *k;
 
@@ -39,12 +40,15 @@ void init_gl_resources(struct wterm *wt, int width, int height)
         glGenTextures(1, &wt->tex_color_buffer);
         glBindTexture(GL_TEXTURE_2D, wt->tex_color_buffer);
 
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        /* It's drawn at its own size, so it doesn't need mipmaps. */
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
         /* TODO: Don't use the window width and height here. */
         glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0,
                      GL_RGB, GL_UNSIGNED_BYTE, NULL);
+        wt->tex_width = width;
+        wt->tex_height = height;
 
         glBindTexture(GL_TEXTURE_2D, 0);
 
@@ -80,9 +84,6 @@ static void wterm_change_font_size(struct wterm *wt, int delta)
 void window_change_font_size(struct wterm *wt, int delta)
 {
         wterm_change_font_size(wt, delta);
-        platform_inform_subprocess_of_resize(wt->subprocess,
-                                             wt->term->g->col,
-                                             wt->term->g->row);
 }
 
 static void remove_wterm(struct window *w, struct wterm *wt)
@@ -102,10 +103,21 @@ static void end_shell(void *arg)
 {
         struct wterm *wt = (struct wterm *)arg;
         struct window *w = wt->window;
+        paste_free(wt->paste);
+        wt->paste = NULL;
+        platform_close_shell(wt->subprocess);
+        wt->subprocess = NULL;
         remove_wterm(w, wt);
         if (k->focus == wt)
                 k->focus = w->wterm;
         window_place(w, w->x0, w->y0, w->x1, w->y1);
+
+        term_free(wt->term);
+        free(wt->term);
+        render_free_rows(&wt->rows);
+        glDeleteFramebuffers(1, &wt->framebuffer);
+        glDeleteTextures(1, &wt->tex_color_buffer);
+        free(wt);
 }
 
 void window_spawn(struct window *w)
@@ -149,6 +161,7 @@ void window_place(struct window *w, int x0, int y0, int x1, int y1)
         w->y0 = y0;
         w->x1 = x1;
         w->y1 = y1;
+        w->stale = true;
 
         if (!w->wterm) return;
 
@@ -165,17 +178,103 @@ void window_place(struct window *w, int x0, int y0, int x1, int y1)
                         window_set_wterm_dimensions(wt);
                         term_resize(wt->term, wt->width / wt->cw,
                                     wt->height / (wt->ch + LINE_SPACING));
-                        platform_inform_subprocess_of_resize(wt->subprocess,
-                                                             wt->term->g->col,
-                                                             wt->term->g->row);
                 }
         }
 }
 
-void window_render(struct window *w, struct font_renderer *r)
+/*
+ * Tell each shell its size if it has changed since it was last told.
+ * This is left to `global_update` so that it happens once things have
+ * settled rather than at every step of a resize.
+ */
+void window_inform(struct window *w)
 {
+        if (!w) return;
+
+        window_inform(w->left);
+        window_inform(w->right);
+
+        for (struct wterm *wt = w->wterm; wt; wt = wt->next) {
+                if (wt->col == wt->term->g->col && wt->row == wt->term->g->row)
+                        continue;
+
+                wt->col = wt->term->g->col;
+                wt->row = wt->term->g->row;
+                platform_inform_subprocess_of_resize(wt->subprocess, wt->col, wt->row);
+        }
+}
+
+/*
+ * Let each wterm catch up on whatever its shell has said since the
+ * last frame. The list is walked with a saved `next` because a shell
+ * which has exited removes its wterm from the list. Returns whether
+ * any wterm used up its whole budget and probably has more waiting.
+ */
+bool window_update(struct window *w)
+{
+        struct wterm *next;
+        bool more = false;
+
+        for (struct wterm *wt = w->wterm; wt; wt = next) {
+                next = wt->next;
+                if (platform_drain(wt->subprocess, PTY_DRAIN_BUDGET) == PTY_DRAIN_BUDGET)
+                        more = true;
+        }
+
+        return more;
+}
+
+void window_paste(struct wterm *wt, const char *s)
+{
+        if (!s) return;
+        if (wt->paste) window_cancel_paste(wt);
+        wt->paste = paste_start(s, wt->term->mode & MODE_BRACKETED_PASTE);
+}
+
+void window_cancel_paste(struct wterm *wt)
+{
+        if (!wt->paste) return;
+        paste_cancel(wt->paste, wt->subprocess);
+        paste_free(wt->paste);
+        wt->paste = NULL;
+}
+
+/*
+ * Send off whatever was typed or pasted into each wterm since the last
+ * frame. Returns whether any of it is still waiting for the shell to
+ * make room.
+ */
+bool window_flush(struct window *w)
+{
+        bool more = false;
+
+        for (struct wterm *wt = w->wterm; wt; wt = wt->next) {
+                if (wt->paste && paste_feed(wt->paste, wt->subprocess)) {
+                        paste_free(wt->paste);
+                        wt->paste = NULL;
+                }
+
+                if (platform_flush(wt->subprocess) || wt->paste) more = true;
+        }
+
+        return more;
+}
+
+/*
+ * Draws each wterm that has changed and puts them all on the screen.
+ * Returns whether anything was drawn, since if nothing was, what's on
+ * the screen already is still right.
+ */
+bool window_render(struct window *w, struct font_renderer *r)
+{
+        bool drew = w->stale;
+
         for (struct wterm *wt = w->wterm; wt; wt = wt->next)
-                render_wterm(r, wt);
+                drew |= render_wterm(r, wt);
+
+        if (!drew) return false;
+
+        w->stale = false;
 
         glBindFramebuffer(GL_FRAMEBUFFER, 0);
         glClearColor(0, 1, 0, 1);
@@ -200,4 +299,6 @@ void window_render(struct window *w, struct font_renderer *r)
                                     wt->tex_color_buffer);
                 }
         }
+
+        return true;
 }
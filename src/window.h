@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdio.h>
 #include <sys/ioctl.h>
 #include <unistd.h>
@@ -7,6 +8,7 @@
 #include <GL/glew.h>
 
 #include "platform.h"
+#include "render.h"
 
 struct global;
 struct font_renderer;
@@ -18,12 +20,16 @@ struct window {
                 /* TODO: Make these opaque handles for a graphics API. */
                 GLuint framebuffer;
                 GLuint tex_color_buffer;
+                int tex_width, tex_height;
+                struct rowbuffer rows;
 
                 int cw, ch;
                 int width, height;
                 int font_size;
+                int col, row;   /* The size the shell was last told */
 
                 struct term *term;
+                struct paste *paste; /* The paste in progress, if any */
 
                 struct window *window;
                 struct wterm *prev, *next;
@@ -38,15 +44,23 @@ struct window {
         float split;
         int x0, y0, x1, y1;
         int nterm;
+
+        /* Whether it has to be drawn again even if no wterm has changed. */
+        bool stale;
 };
 
 void window_init(struct window *w);
 void window_place(struct window *w, int x0, int y0, int x1, int y1);
+void window_inform(struct window *w);
 void window_spawn(struct window *w);
 void window_change_font_size(struct wterm *wt, int delta);
+bool window_update(struct window *w);
+bool window_flush(struct window *w);
+void window_paste(struct wterm *wt, const char *s);
+void window_cancel_paste(struct wterm *wt);
 
 /*
  * TODO: Move rendering out of individual components and into
  * `render.c`.
  */
-void window_render(struct window *w, struct font_renderer *r);
+bool window_render(struct window *w, struct font_renderer *r);
@@ -0,0 +1,155 @@
+#!/usr/bin/env python3
+#
+# Generates src/wcwidth.c, the table behind `kty_wcwidth`.
+#
+#     tools/wcwidth.py [UCD directory] > src/wcwidth.c
+#
+# The directory should hold EastAsianWidth.txt, DerivedGeneralCategory.txt
+# and emoji/emoji-data.txt from https://www.unicode.org/Public/UCD/latest/.
+# Without it Python's own unicodedata is used, which is only as new as the
+# Python running this.
+#
+# Widths are:
+#
+#   -1  C0 and C1 controls and DEL
+#    0  NUL, combining marks, zero width format characters and Hangul
+#       medial vowels and final consonants
+#    2  East Asian Wide and Fullwidth, and emoji presented as emoji
+#    1  everything else, including unassigned code points
+#
+# The table has two levels. The top byte of a code point (c >> 8) picks
+# a block of 256 entries and each entry is two bits holding width + 1.
+# Identical blocks are only stored once.
+
+import os
+import sys
+
+MAX = 0x110000
+
+
+def ranges(path, want):
+    """Yields (first, last, value) for lines of a UCD file in `want`."""
+    with open(path, encoding="utf-8") as f:
+        for line in f:
+            line = line.split("#")[0].strip()
+            if not line:
+                continue
+            cps, value = [x.strip() for x in line.split(";")[:2]]
+            if value not in want:
+                continue
+            first, _, last = cps.partition("..")
+            yield int(first, 16), int(last or first, 16), value
+
+
+def load_ucd(d):
+    wide, zero = set(), set()
+
+    for first, last, _ in ranges(os.path.join(d, "EastAsianWidth.txt"), {"W", "F"}):
+        wide.update(range(first, last + 1))
+
+    for first, last, _ in ranges(os.path.join(d, "emoji", "emoji-data.txt"),
+                                 {"Emoji_Presentation"}):
+        wide.update(range(first, last + 1))
+
+    for first, last, _ in ranges(os.path.join(d, "DerivedGeneralCategory.txt"),
+                                 {"Mn", "Me", "Cf"}):
+        zero.update(range(first, last + 1))
+
+    return wide, zero
+
+
+def load_python():
+    import unicodedata
+
+    wide, zero = set(), set()
+
+    for c in range(MAX):
+        ch = chr(c)
+        # unicodedata calls unassigned code points Fullwidth.
+        if unicodedata.category(ch) == "Cn":
+            continue
+        if unicodedata.east_asian_width(ch) in ("W", "F"):
+            wide.add(c)
+        if unicodedata.category(ch) in ("Mn", "Me", "Cf"):
+            zero.add(c)
+
+    # Since Unicode 9 everything with Emoji_Presentation is also East
+    # Asian Wide, so there's nothing more to add for emoji.
+    return wide, zero
+
+
+def widths(wide, zero):
+    w = [1] * MAX
+
+    # Unassigned code points in the CJK blocks default to wide.
+    for first, last in ((0x3400, 0x4dbf), (0x4e00, 0x9fff), (0xf900, 0xfaff),
+                        (0x20000, 0x2fffd), (0x30000, 0x3fffd)):
+        for c in range(first, last + 1):
+            w[c] = 2
+
+    for c in wide:
+        w[c] = 2
+
+    for c in zero:
+        w[c] = 0
+
+    # The soft hyphen and the prepended concatenation marks (like the
+    # Arabic number sign) are format characters which are still drawn.
+    for c in (0x00ad, 0x0600, 0x0601, 0x0602, 0x0603, 0x0604, 0x0605,
+              0x06dd, 0x070f, 0x0890, 0x0891, 0x08e2, 0x110bd, 0x110cd):
+        w[c] = 1
+
+    # Hangul syllables decompose into jamo; the medial vowels and final
+    # consonants combine with the initial consonant before them.
+    for c in range(0x1160, 0x1200):
+        w[c] = 0
+    for c in range(0xd7b0, 0xd800):
+        w[c] = 0
+
+    for c in list(range(0x01, 0x20)) + list(range(0x7f, 0xa0)):
+        w[c] = -1
+
+    w[0] = 0
+
+    return w
+
+
+def main():
+    wide, zero = load_ucd(sys.argv[1]) if len(sys.argv) > 1 else load_python()
+    w = widths(wide, zero)
+
+    blocks, index = [], []
+    seen = {}
+
+    for hi in range(MAX >> 8):
+        packed = bytearray(64)
+        for lo in range(256):
+            packed[lo >> 2] |= (w[hi << 8 | lo] + 1) << (lo & 3) * 2
+        packed = bytes(packed)
+        if packed not in seen:
+            seen[packed] = len(blocks)
+            blocks.append(packed)
+        index.append(seen[packed])
+
+    assert len(blocks) <= 256
+
+    out = sys.stdout
+    out.write("/* Generated by tools/wcwidth.py; do not edit. */\n\n")
+    out.write('#include "wcwidth.h"\n\n')
+
+    out.write("const uint8_t wcwidth_index[0x%x] = {\n" % len(index))
+    for i in range(0, len(index), 16):
+        out.write("        " + " ".join("%d," % x for x in index[i:i + 16]) + "\n")
+    out.write("};\n\n")
+
+    out.write("const uint8_t wcwidth_blocks[%d][64] = {\n" % len(blocks))
+    for b in blocks:
+        out.write("        {\n")
+        for i in range(0, 64, 16):
+            out.write("                " + " ".join("0x%02x," % x for x in b[i:i + 16]) + "\n")
+        out.write("        },\n")
+    out.write("};\n")
+
+
+if __name__ == "__main__":
+    main()